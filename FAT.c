@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,12 +8,24 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#endif
 
 #define DIR_ENTRY_SIZE 32
 #define ATTR_DIRECTORY 0x10
 #define MAX_OPEN_FILES 10 
 
-//bootsector struct
+//bootsector struct. the fields after sizeOfImage are the volume geometry, worked
+//out once from the BPB by initGeometry so hot paths only shift and add
 typedef struct {
     unsigned short bytesPerSector;
     unsigned char sectorsPerCluster;
@@ -20,13 +33,103 @@ typedef struct {
     unsigned int totalClusters; 
     unsigned int sectorsPerFAT;
     unsigned long long sizeOfImage; 
+    unsigned short reservedSectors;
+    unsigned char numFATs;
+    uint64_t fatStart;             //byte offset of the first FAT
+    uint64_t dataStart;            //byte offset of cluster 2
+    unsigned int sectorShift;      //log2 of bytesPerSector
+    unsigned int clusterShift;     //log2 of the cluster size in bytes
+    unsigned int clusterMask;      //cluster size - 1
 } BootSectorInfo;
 
 unsigned int getNextCluster(int fd, unsigned int currentCluster, BootSectorInfo* bsi);
+unsigned int getFileCluster(int fd, unsigned int firstCluster, unsigned int index, BootSectorInfo* bsi);
+bool setFatEntry(int fd, unsigned int cluster, unsigned int value, BootSectorInfo* bsi);
+unsigned int allocateCluster(int fd, BootSectorInfo* bsi);
+bool freeCluster(int fd, unsigned int cluster, BootSectorInfo* bsi);
 
-//struct that contains the current cluster, the name  and the name of the image
+#define FAT_PAGE_SECTORS 32             //FAT sectors faulted in together
+#define DEFAULT_FAT_CACHE_MB 64
+
+#define BIT_TEST(map, i) (((map)[(i) / 8] >> ((i) % 8)) & 1)
+#define BIT_SET(map, i) ((map)[(i) / 8] |= (unsigned char)(1 << ((i) % 8)))
+#define BIT_CLEAR(map, i) ((map)[(i) / 8] &= (unsigned char)~(1 << ((i) % 8)))
+
+//seconds on a clock that doesn't jump, used to age dirty data
+time_t monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+//demand-paged copy of the FAT. pages are faulted in on first touch and evicted
+//with a clock sweep once maxPages are resident. if the whole FAT fits under the
+//cap it is read at mount into one contiguous block and nothing is ever evicted
+typedef struct {
+    uint32_t** pages;              //one pointer per page, NULL until loaded
+    unsigned char* loaded;         //bitmap, one bit per page
+    unsigned char* referenced;     //bitmap used by the clock sweep
+    unsigned char* dirtySectors;   //bitmap, one bit per FAT sector
+    unsigned char* contiguous;     //backing block when fully resident
+    unsigned int numPages;
+    unsigned int numEntries;
+    unsigned int entriesPerPage;
+    unsigned int loadedPages;
+    unsigned int maxPages;
+    unsigned int clockHand;
+    unsigned int dirtyCount;
+    time_t dirtySince;             //when the oldest unwritten change was made
+    unsigned long long hits;
+    unsigned long long misses;
+} FatTable;
+
+FatTable fatTable;
+void freeFatTable();
+unsigned long long fatCacheLimit = (unsigned long long)DEFAULT_FAT_CACHE_MB * 1024 * 1024;
+
+//one contiguous run of a cluster chain: start, start+1, ... start+length-1, then next
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+    unsigned int next;     //0xFFFFFFFF when the chain ends with the run
+} FatExtent;
+
+//the runs of one chain in chain order. offsets[i] is how many clusters of the
+//chain come before starts[i], so the index-th cluster is one binary search away
+typedef struct {
+    unsigned int firstCluster;     //0 when the entry is free
+    unsigned int count;
+    unsigned int total;            //clusters in the chain
+    unsigned int* starts;
+    unsigned int* offsets;
+    unsigned long long lastUsed;
+} ExtentChain;
+
+#define MAX_EXTENT_CHAINS 16
+
+//run-length compressed view of the FAT, sorted by start so lookups are a binary search
+//FAT updates split and merge the runs around the entry in place. chains of files
+//being read are kept with their offsets, a change to a cluster in a chain drops them
+typedef struct {
+    FatExtent* runs;
+    unsigned int count;
+    unsigned int capacity;
+    bool valid;
+    ExtentChain chains[MAX_EXTENT_CHAINS];
+    unsigned long long chainClock;
+} FatExtentIndex;
+
+FatExtentIndex extentIndex;
+bool useExtentIndex = false;
+
+#define MAX_DIR_DEPTH 64
+
+//struct that contains the current cluster, the name  and the name of the image.
+//parents holds the clusters of the directories above, root first, so '..' pops one
 typedef struct {
     unsigned int currentCluster; 
+    unsigned int parents[MAX_DIR_DEPTH];
+    unsigned int depth;
     char path[512]; 
     char imageName[256]; 
 } DirectoryContext;
@@ -37,12 +140,110 @@ DirectoryContext currentDirectory;
 typedef struct {
     char name[11];
     uint8_t attr;
-    uint8_t reserved[20];
-    uint16_t firstClusterHigh;
-    uint16_t firstClusterLow;
+    uint8_t reserved[8];           //case flags and creation/access times
+    uint16_t firstClusterHigh;     //offset 20
+    uint8_t modified[4];           //write time and date
+    uint16_t firstClusterLow;      //offset 26
     uint32_t fileSize;
 } DirEntry;
 
+//log2 of a power of two, -1 if it isn't one
+int log2Exact(unsigned int value) {
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+    int shift = 0;
+    while ((1u << shift) != value) shift++;
+    return shift;
+}
+
+//fill in the derived geometry: the FATs follow the reserved sectors and the data
+//region follows the FATs. sector and cluster sizes must be powers of two
+bool initGeometry(BootSectorInfo* bsi) {
+    int sectorShift = log2Exact(bsi->bytesPerSector);
+    int clusterSectorShift = log2Exact(bsi->sectorsPerCluster);
+    if (sectorShift < 9 || sectorShift > 12 || clusterSectorShift < 0 || clusterSectorShift > 7 ||
+        bsi->numFATs == 0 || bsi->sectorsPerFAT == 0) {
+        printf("Error: Unsupported volume geometry\n");
+        return false;
+    }
+
+    bsi->sectorShift = sectorShift;
+    bsi->clusterShift = sectorShift + clusterSectorShift;
+    bsi->clusterMask = (1u << bsi->clusterShift) - 1;
+    bsi->fatStart = (uint64_t)bsi->reservedSectors << sectorShift;
+    bsi->dataStart = bsi->fatStart + ((uint64_t)bsi->numFATs * bsi->sectorsPerFAT << sectorShift);
+
+    //the data region ends at the image or at the last whole cluster the FAT can describe
+    uint64_t dataBytes = bsi->sizeOfImage > bsi->dataStart ? bsi->sizeOfImage - bsi->dataStart : 0;
+    uint64_t clusters = dataBytes >> bsi->clusterShift;
+    uint64_t fatEntries = ((uint64_t)bsi->sectorsPerFAT << sectorShift) / 4;
+    if (clusters > fatEntries - 2) clusters = fatEntries - 2;
+    bsi->totalClusters = (unsigned int)clusters;
+    return true;
+}
+
+//read the fields we use out of the BIOS parameter block
+bool parseBootSector(const unsigned char* bootSector, unsigned long long sizeOfImage, BootSectorInfo* bsi) {
+    memset(bsi, 0, sizeof(*bsi));
+    bsi->bytesPerSector = *(unsigned short *)(bootSector + 11);
+    bsi->sectorsPerCluster = *(bootSector + 13);
+    bsi->reservedSectors = *(unsigned short *)(bootSector + 14);
+    bsi->numFATs = *(bootSector + 16);
+    bsi->sectorsPerFAT = *(unsigned int *)(bootSector + 36);
+    bsi->rootCluster = *(unsigned int *)(bootSector + 44);
+    bsi->sizeOfImage = sizeOfImage;
+    return initGeometry(bsi);
+}
+
+//geometry helpers. every cluster, sector and byte offset is computed here in 64
+//bits from the precomputed shifts, a 32-bit product wraps past 4 GB
+unsigned int clusterBytes(BootSectorInfo* bsi) {
+    return 1u << bsi->clusterShift;
+}
+
+unsigned int entriesPerCluster(BootSectorInfo* bsi) {
+    return clusterBytes(bsi) / DIR_ENTRY_SIZE;
+}
+
+uint64_t sectorToOffset(uint64_t sector, BootSectorInfo* bsi) {
+    return sector << bsi->sectorShift;
+}
+
+//byte offset of a cluster in the image
+off_t clusterOffset(uint32_t clusterNum, BootSectorInfo* bsi) {
+    return bsi->dataStart + ((uint64_t)(clusterNum - 2) << bsi->clusterShift);
+}
+
+//which cluster of a file a byte offset falls in, and where in that cluster
+uint32_t clusterIndexOf(uint64_t offset, BootSectorInfo* bsi) {
+    return (uint32_t)(offset >> bsi->clusterShift);
+}
+
+uint32_t offsetInCluster(uint64_t offset, BootSectorInfo* bsi) {
+    return (uint32_t)(offset & bsi->clusterMask);
+}
+
+//byte offset of the first FAT in the image
+off_t fatOffsetInImage(BootSectorInfo* bsi) {
+    return (off_t)bsi->fatStart;
+}
+
+//FAT sector holding a cluster's entry, counted from the start of the FAT
+uint32_t fatEntrySector(uint32_t clusterNum, BootSectorInfo* bsi) {
+    return (uint32_t)(((uint64_t)clusterNum * 4) >> bsi->sectorShift);
+}
+
+//byte offset of a cluster's 4-byte FAT entry in the image
+off_t fatEntryOffset(uint32_t clusterNum, BootSectorInfo* bsi) {
+    return fatOffsetInImage(bsi) + (off_t)clusterNum * 4;
+}
+
+//first cluster of a directory entry, high half first
+uint32_t dirEntryCluster(const DirEntry* entry) {
+    return ((uint32_t)entry->firstClusterHigh << 16) | entry->firstClusterLow;
+}
+
 //struct to handle file opening
 //flags determine operation to carry out based on command input
 typedef struct {
@@ -52,463 +253,3315 @@ typedef struct {
     unsigned int cluster; 
     unsigned int size;    
     bool isOpen;          
+    unsigned long lastReadEnd;     //where the previous read stopped, reads starting here are sequential
+    unsigned int raWindow;         //read-ahead window in clusters, 0 until reads turn sequential
+    unsigned long raEnd;           //file offset read-ahead has already covered
+    unsigned int dirCluster;       //first cluster of the directory holding the entry
+    unsigned int dirPosition;      //entry number within that directory
 } OpenFile;
 
 OpenFile openFiles[MAX_OPEN_FILES];  //aqrray to store open files
 
-//read data from a cluster and load it into memory buffer
-bool readCluster(int fd, unsigned int clusterNum, unsigned char* buffer, BootSectorInfo* bsi) {
-    unsigned long long sector = ((clusterNum - 2) * bsi->sectorsPerCluster) + bsi->rootCluster;
-    off_t offset = sector * bsi->bytesPerSector;
+//in-memory image. with --mmap it is a shared mapping of the file, with --ram it is
+//an anonymous copy that only reaches the file on sync or exit. dirty host pages are
+//tracked so a flush only touches what changed
+unsigned char* imageMap = NULL;
+size_t imageMapSize = 0;
+unsigned char* mapDirtyPages = NULL;  //bitmap, one bit per host page
+size_t mapPageSize = 0;
+bool imageInRam = false;
 
-    //seek to the cluster
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        perror("Error seeking cluster");
-        return false;
-    }
-    //read the cluster
-    if (read(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-        perror("Error reading cluster");
-        return false;
+void markImageDirty(off_t offset, size_t length) {
+    for (size_t page = offset / mapPageSize; page <= (offset + length - 1) / mapPageSize; page++) {
+        BIT_SET(mapDirtyPages, page);
     }
-
-    return true;
 }
 
-//fucntion to handle the cd command
-void changeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
-    if (strcmp(dirName, ".") == 0) {
-        printf("Staying in the current directory.\n");
-        return; 
-    }
-
-    if (strcmp(dirName, "..") == 0) {
-        if (strcmp(context->path, "/") == 0) {
-            printf("Already in the root directory.\n");
-            return; 
+//positional I/O layer. every image access goes through these so the fd offset is
+//never shared state, and short reads/writes or EINTR are retried until done
+bool preadFull(int fd, void* buffer, size_t count, off_t offset) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pread(fd, (unsigned char*)buffer + total, count - total, offset + total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return false;
         }
+        total += n;
+    }
+    return true;
+}
 
-        //check for and handle slash in input
-        char* lastSlash = strrchr(context->path, '/');
-        if (lastSlash != NULL) {
-            if (lastSlash == context->path) {
-                *(lastSlash + 1) = '\0'; 
-            } else {
-                *lastSlash = '\0';
-            }
+bool pwriteFull(int fd, const void* buffer, size_t count, off_t offset) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pwrite(fd, (const unsigned char*)buffer + total, count - total, offset + total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return false;
         }
-
-        context->currentCluster = bsi->rootCluster;
-        printf("Changed directory to parent: %s\n", context->path);
-        return;
+        total += n;
     }
+    return true;
+}
 
-    //allocate memory for reeading cluster
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory\n");
-        return;
-    }
+//copy-on-write overlay for --overlay. the base image is opened read-only and every
+//modified block is stored at the same offset in a sparse sidecar file. blocks line
+//up with what the filesystem writes: the data area is kept in clusters counted
+//from dataStart, the reserved sectors and FATs in sectors, each in its own set of
+//block numbers (open addressing, ~0 marks a free slot). the sidecar's holes can't
+//tell which blocks were written (the host filesystem allocates in its own block
+//size), so the block numbers are also appended to an index file next to it
+//(FILE.idx) and read back from there on open
+typedef struct {
+    uint64_t* blocks;
+    size_t capacity;
+    size_t count;
+} OverlayMap;
 
-    //if you cannot read from the cluster, free the buffer and exit the fucntion
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
-    }
+typedef struct {
+    int fd;
+    int indexFd;
+    size_t sectorSize;
+    size_t clusterSize;
+    uint64_t dataStart;
+    OverlayMap sectors;    //sector numbers below dataStart
+    OverlayMap clusters;   //cluster numbers, the first data cluster is 2
+} Overlay;
 
-    //initialize entry pointer
-    DirEntry* entry = (DirEntry*)buffer;
-    int entriesCount = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool found = false;
+Overlay overlay = { .fd = -1, .indexFd = -1 };
 
-    //loop through direectory entries
-    for (int i = 0; i < entriesCount; i++, entry++) {
-        //error handling
-        if (entry->name[0] == 0x00) {
-            printf("Reached end of directory entries.\n");
-            break; 
-        }
-        if ((unsigned char)entry->name[0] == 0xE5) {
-            printf("Skipped a deleted entry.\n");
-            continue; 
-        }
+#define OVERLAY_MAGIC "FATOVL2"
 
-        //format the name of the directory
-        char formattedName[12];
-        strncpy(formattedName, entry->name, 11);
-        formattedName[11] = '\0';
+//index file header, followed by one uint64_t record per written block: a cluster
+//number, or a sector number with OVERLAY_SECTOR set
+typedef struct {
+    char magic[8];
+    uint64_t sectorSize;
+    uint64_t clusterSize;
+    uint64_t dataStart;
+} OverlayIndexHeader;
 
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
-        }
+#define OVERLAY_EMPTY UINT64_MAX
+#define OVERLAY_SECTOR (1ULL << 63)
 
-        if ((entry->attr & ATTR_DIRECTORY) && strcmp(formattedName, dirName) == 0) {
-            unsigned int newCluster = (entry->firstClusterHigh << 16) | entry->firstClusterLow;
-            if (newCluster == 0) newCluster = bsi->rootCluster; 
+size_t overlaySlot(uint64_t block, size_t capacity) {
+    return (block * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+}
 
-            //update the path and the current cluster
-            char newPath[512];
-            if (snprintf(newPath, sizeof(newPath), "%s/%s", context->path, dirName) >= (int)sizeof(newPath)) {
-                printf("Error: New path too long\n");
-                free(buffer);
-                return;
-            }
-            strncpy(context->path, newPath, sizeof(context->path));
-            context->path[sizeof(context->path) - 1] = '\0'; 
+bool overlayHasBlock(OverlayMap* map, uint64_t block) {
+    for (size_t i = overlaySlot(block, map->capacity); ; i = (i + 1) & (map->capacity - 1)) {
+        if (map->blocks[i] == block) return true;
+        if (map->blocks[i] == OVERLAY_EMPTY) return false;
+    }
+}
 
-            context->currentCluster = newCluster;
-            found = true;
-            printf("Changed directory to %s\n", dirName);
-            break;
+bool overlayAddBlock(OverlayMap* map, uint64_t block) {
+    //keep the table under 70% full
+    if ((map->count + 1) * 10 > map->capacity * 7) {
+        size_t capacity = map->capacity * 2;
+        uint64_t* blocks = malloc(capacity * sizeof(uint64_t));
+        if (!blocks) {
+            printf("Failed to allocate memory for overlay index\n");
+            return false;
         }
+        memset(blocks, 0xFF, capacity * sizeof(uint64_t));
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->blocks[i] == OVERLAY_EMPTY) continue;
+            size_t j = overlaySlot(map->blocks[i], capacity);
+            while (blocks[j] != OVERLAY_EMPTY) j = (j + 1) & (capacity - 1);
+            blocks[j] = map->blocks[i];
+        }
+        free(map->blocks);
+        map->blocks = blocks;
+        map->capacity = capacity;
     }
 
-    //if directory is not found, print error message 
-    if (!found) {
-        printf("Directory not found: %s\n", dirName);
+    size_t i = overlaySlot(block, map->capacity);
+    while (map->blocks[i] != OVERLAY_EMPTY) {
+        if (map->blocks[i] == block) return true;
+        i = (i + 1) & (map->capacity - 1);
     }
-
-    free(buffer);
+    map->blocks[i] = block;
+    map->count++;
+    return true;
 }
 
-//info function
-void printBootSectorInfo(const char *imagePath) {
-    //open the image with correct permissions
-    int fd = open(imagePath, O_RDONLY);
-    if (fd < 0) {
-        perror("Failed to open image file");
-        return;
+bool initOverlayMap(OverlayMap* map) {
+    map->capacity = 1024;
+    map->count = 0;
+    map->blocks = malloc(map->capacity * sizeof(uint64_t));
+    if (!map->blocks) {
+        printf("Failed to allocate memory for overlay index\n");
+        return false;
     }
+    memset(map->blocks, 0xFF, map->capacity * sizeof(uint64_t));
+    return true;
+}
 
-    //read the boot sector and print an error message if failed
-    unsigned char bootSector[512];
-    if (read(fd, bootSector, sizeof(bootSector)) != sizeof(bootSector)) {
-        perror("Failed to read boot sector");
-        close(fd);
-        return;
-    }
+void clearOverlayIndex() {
+    memset(overlay.sectors.blocks, 0xFF, overlay.sectors.capacity * sizeof(uint64_t));
+    overlay.sectors.count = 0;
+    memset(overlay.clusters.blocks, 0xFF, overlay.clusters.capacity * sizeof(uint64_t));
+    overlay.clusters.count = 0;
+}
 
-    //print the size of the image file
-    struct stat st;
-    if (fstat(fd, &st) != 0) {
-        perror("Failed to get image file size");
-        close(fd);
-        return;
-    }
+//the block holding an image offset: which map it is in, its number there, where
+//it starts and how long it is
+typedef struct {
+    OverlayMap* map;
+    uint64_t number;
+    off_t start;
+    size_t size;
+} OverlayBlock;
 
-    //populate all values for an instance of BootSectorInfo
-    BootSectorInfo info = {
-        .bytesPerSector = *(unsigned short *)(bootSector + 11),
-        .sectorsPerCluster = *(bootSector + 13),
-        .rootCluster = *(unsigned int *)(bootSector + 44),
-        .sectorsPerFAT = *(unsigned int *)(bootSector + 36),
-        .sizeOfImage = st.st_size
-    };
-    info.totalClusters = (st.st_size / (info.sectorsPerCluster * info.bytesPerSector));
+OverlayBlock overlayBlock(OverlayMap* map, uint64_t number) {
+    if (map == &overlay.sectors) {
+        return (OverlayBlock){ map, number, (off_t)(number * overlay.sectorSize), overlay.sectorSize };
+    }
+    return (OverlayBlock){ map, number, (off_t)(overlay.dataStart + (number - 2) * overlay.clusterSize), overlay.clusterSize };
+}
 
-    //print all data values
-    printf("Bytes Per Sector: %u\n", info.bytesPerSector);
-    printf("Sectors Per Cluster: %u\n", info.sectorsPerCluster);
-    printf("Root Cluster: %u\n", info.rootCluster);
-    printf("Total # of Clusters in Data Region: %u\n", info.totalClusters);
-    printf("# of Entries in One FAT: %u\n", info.sectorsPerFAT);
-    printf("Size of Image (in bytes): %llu\n", info.sizeOfImage);
+OverlayBlock overlayBlockAt(off_t offset) {
+    if ((uint64_t)offset < overlay.dataStart) {
+        return overlayBlock(&overlay.sectors, offset / overlay.sectorSize);
+    }
+    return overlayBlock(&overlay.clusters, (offset - overlay.dataStart) / overlay.clusterSize + 2);
+}
 
-    close(fd);
+//record a newly written block in the index file. the block's data is already in
+//the sidecar, so a crash before this leaves the block unreferenced, not half-read
+bool overlayLogBlock(const OverlayBlock* block) {
+    uint64_t record = block->map == &overlay.sectors ? block->number | OVERLAY_SECTOR : block->number;
+    off_t end = lseek(overlay.indexFd, 0, SEEK_END);
+    return end >= 0 && pwriteFull(overlay.indexFd, &record, sizeof(record), end);
 }
 
-//fucntion to handle ls command
-void listDirectory(int fd, DirectoryContext* context, BootSectorInfo* bsi) {
-    //like all functions, allocate memeory to read from the cluster
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for reading cluster\n");
-        return;
+//load the block numbers a previous session recorded, or start a new index file.
+//a sidecar that has data but no index can't be trusted and is refused
+bool loadOverlayIndex(const char* path, int overlayFd) {
+    char indexPath[4096];
+    if (snprintf(indexPath, sizeof(indexPath), "%s.idx", path) >= (int)sizeof(indexPath)) {
+        printf("Error: Overlay path is too long\n");
+        return false;
     }
-    //if failed, clear the buffer and exit
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
+    int indexFd = open(indexPath, O_RDWR | O_CREAT, 0644);
+    if (indexFd < 0) {
+        perror("Error opening overlay index");
+        return false;
     }
+    overlay.indexFd = indexFd;
 
-    //initialize entry buffer and print '.' and '..'
-    DirEntry* entry = (DirEntry*) buffer;
-    int entriesCount = (bsi->bytesPerSector * bsi->sectorsPerCluster) / DIR_ENTRY_SIZE;
-    printf(".\n..\n"); 
-
-    //print all entries unless it was deleted
-    for (int i = 0; i < entriesCount; i++, entry++) {
-        if (entry->name[0] == 0x00) break; 
-        if ((unsigned char)entry->name[0] == 0xE5) continue;
+    struct stat indexStat, overlayStat;
+    if (fstat(indexFd, &indexStat) < 0 || fstat(overlayFd, &overlayStat) < 0) {
+        perror("Error reading overlay");
+        return false;
+    }
 
-        printf("%.11s\n", entry->name); 
+    OverlayIndexHeader header;
+    if (indexStat.st_size == 0) {
+        if (overlayStat.st_size > 0) {
+            printf("Error: Overlay %s has data but no block index (%s)\n", path, indexPath);
+            return false;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+        header.sectorSize = overlay.sectorSize;
+        header.clusterSize = overlay.clusterSize;
+        header.dataStart = overlay.dataStart;
+        if (!pwriteFull(indexFd, &header, sizeof(header), 0)) {
+            perror("Error writing overlay index");
+            return false;
+        }
+        return true;
     }
-    free(buffer);
-}
 
-//function to handle mkdir 
-void createDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
-        return;
+    if (!preadFull(indexFd, &header, sizeof(header), 0) ||
+        memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Error: %s is not an overlay index\n", indexPath);
+        return false;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
+    if (header.sectorSize != overlay.sectorSize || header.clusterSize != overlay.clusterSize ||
+        header.dataStart != overlay.dataStart) {
+        printf("Error: Overlay was written for a different layout (%llu-byte sectors, %llu-byte clusters, data at %llu)\n",
+               (unsigned long long)header.sectorSize, (unsigned long long)header.clusterSize,
+               (unsigned long long)header.dataStart);
+        return false;
     }
 
-    DirEntry* entries = (DirEntry*) buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool foundSpace = false;
-
-    //search for a free entry
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00 || (unsigned char)entries[i].name[0] == 0xE5) { 
-            memset(&entries[i], 0, sizeof(DirEntry)); 
-            strncpy(entries[i].name, dirName, 11); 
-            entries[i].attr = ATTR_DIRECTORY;
-
-            // Assign a new cluster for the directory different from the current one
-            entries[i].firstClusterLow = context->currentCluster + 1; 
-            entries[i].firstClusterHigh = 0;
-            entries[i].fileSize = 0; 
-
-            foundSpace = true;
-            break;
+    //a torn final record from a crash is ignored
+    size_t records = (indexStat.st_size - sizeof(header)) / sizeof(uint64_t);
+    uint64_t batch[512];
+    for (size_t done = 0; done < records; ) {
+        size_t n = records - done < 512 ? records - done : 512;
+        if (!preadFull(indexFd, batch, n * sizeof(uint64_t), sizeof(header) + done * sizeof(uint64_t))) {
+            perror("Error reading overlay index");
+            return false;
         }
-    }
-
-    //if the directory is full, print error. if it is created successfully, print a success message
-    if (!foundSpace) {
-        printf("No space in current directory to create new directory\n");
-    } else {
-        off_t offset = (context->currentCluster - 2) * bsi->sectorsPerCluster * bsi->bytesPerSector + bsi->rootCluster * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to write new directory entry");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing new directory entry");
-        } else {
-            printf("Directory created successfully\n");
+        for (size_t i = 0; i < n; i++) {
+            bool added = (batch[i] & OVERLAY_SECTOR) ? overlayAddBlock(&overlay.sectors, batch[i] & ~OVERLAY_SECTOR)
+                                                     : overlayAddBlock(&overlay.clusters, batch[i]);
+            if (!added) return false;
         }
+        done += n;
     }
+    return true;
+}
 
-    free(buffer);
+void freeOverlay() {
+    if (overlay.fd >= 0) {
+        close(overlay.fd);
+    }
+    if (overlay.indexFd >= 0) {
+        close(overlay.indexFd);
+    }
+    free(overlay.sectors.blocks);
+    free(overlay.clusters.blocks);
+    memset(&overlay, 0, sizeof(overlay));
+    overlay.fd = -1;
+    overlay.indexFd = -1;
 }
 
-//function to handle the creation of the file
-void createFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
-        return;
+//open (or create) the sidecar and load the index of blocks a previous session
+//wrote into it
+bool initOverlay(const char* path, BootSectorInfo* bsi) {
+    int overlayFd = open(path, O_RDWR | O_CREAT, 0644);
+    if (overlayFd < 0) {
+        perror("Error opening overlay file");
+        return false;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
+
+    overlay.fd = overlayFd;
+    overlay.sectorSize = bsi->bytesPerSector;
+    overlay.clusterSize = clusterBytes(bsi);
+    overlay.dataStart = bsi->dataStart;
+    if (!initOverlayMap(&overlay.sectors) || !initOverlayMap(&overlay.clusters) ||
+        !loadOverlayIndex(path, overlayFd)) {
+        freeOverlay();
+        return false;
     }
+    return true;
+}
 
-    DirEntry* entries = (DirEntry*) buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool foundSpace = false;
-    bool exists = false;
+//read through the overlay: each block comes from the sidecar if it was modified,
+//otherwise from the base image
+bool overlayRead(int fd, void* buffer, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        OverlayBlock block = overlayBlockAt(offset + done);
+        size_t chunk = block.start + block.size - (offset + done);
+        if (chunk > count - done) chunk = count - done;
 
-    //search for a free entry, similar to mkdir
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00 || (unsigned char)entries[i].name[0] == 0xE5) {
-            if (!foundSpace) {
-                foundSpace = true;
-                memset(&entries[i], 0, sizeof(DirEntry)); 
-                strncpy(entries[i].name, fileName, 11); 
-                entries[i].attr = 0x00; //file attribute
-                entries[i].firstClusterLow = 0; 
-                entries[i].firstClusterHigh = 0;
-                entries[i].fileSize = 0; 
-            }
-        } else {
-            char formattedName[12];
-            strncpy(formattedName, entries[i].name, 11);
-            formattedName[11] = '\0';
+        int source = overlayHasBlock(block.map, block.number) ? overlay.fd : fd;
+        if (!preadFull(source, (unsigned char*)buffer + done, chunk, offset + done)) {
+            return false;
+        }
+        done += chunk;
+    }
+    return true;
+}
 
-            for (int j = 10; j >= 0; j--) {
-                if (formattedName[j] == ' ') formattedName[j] = '\0';
-                else break;
+//write into the sidecar. a block written for the first time is copied up from
+//the base image first unless the write covers all of it
+bool overlayWrite(int fd, const void* buffer, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        OverlayBlock block = overlayBlockAt(offset + done);
+        size_t chunk = block.start + block.size - (offset + done);
+        if (chunk > count - done) chunk = count - done;
+
+        bool fresh = !overlayHasBlock(block.map, block.number);
+        if (fresh && chunk < block.size) {
+            unsigned char* copy = malloc(block.size);
+            if (!copy) {
+                errno = ENOMEM;
+                return false;
             }
+            bool ok = preadFull(fd, copy, block.size, block.start) &&
+                      pwriteFull(overlay.fd, copy, block.size, block.start);
+            free(copy);
+            if (!ok) return false;
+        }
 
-            if (strcmp(formattedName, fileName) == 0) {
-                printf("Error: A file or directory with this name already exists.\n");
-                exists = true;
-                break;
+        if (!pwriteFull(overlay.fd, (const unsigned char*)buffer + done, chunk, offset + done)) {
+            return false;
+        }
+        if (fresh) {
+            if (!overlayLogBlock(&block)) return false;
+            if (!overlayAddBlock(block.map, block.number)) {
+                errno = ENOMEM;
+                return false;
             }
         }
+        done += chunk;
     }
+    return true;
+}
 
-    //Calculate the offset where this directory's data begins in the disk image
-    if (foundSpace && !exists) {
-        unsigned long long sector = ((context->currentCluster - 2) * bsi->sectorsPerCluster) + bsi->rootCluster;
-        off_t offset = sector * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to write new file entry");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing new file entry");
+//copy one map's blocks from the sidecar into the base image. failed blocks are
+//counted and the rest still go
+void commitOverlayMap(int baseFd, OverlayMap* map, unsigned char* buffer, size_t* committed, size_t* failed) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->blocks[i] == OVERLAY_EMPTY) continue;
+        OverlayBlock block = overlayBlock(map, map->blocks[i]);
+        if (!preadFull(overlay.fd, buffer, block.size, block.start) ||
+            !pwriteFull(baseFd, buffer, block.size, block.start)) {
+            perror("Error committing overlay block");
+            (*failed)++;
         } else {
-            printf("File created successfully\n");
+            (*committed)++;
         }
     }
-
-    free(buffer);
 }
 
-//function to handle rm
-void removeFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
+//handle the commit command: merge every overlay block into the base image and
+//start over with an empty sidecar. if any block fails the sidecar is kept whole,
+//so the commit can be run again
+bool commitOverlay(const char* imagePath) {
+    if (overlay.fd < 0) {
+        printf("Error: Not running with an overlay.\n");
+        return false;
+    }
+
+    int baseFd = open(imagePath, O_WRONLY);
+    if (baseFd < 0) {
+        perror("Error opening image for commit");
+        return false;
+    }
+    unsigned char* buffer = malloc(overlay.clusterSize > overlay.sectorSize ? overlay.clusterSize : overlay.sectorSize);
     if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
-        return;
+        printf("Failed to allocate memory for commit\n");
+        close(baseFd);
+        return false;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
+
+    size_t committed = 0;
+    size_t failed = 0;
+    commitOverlayMap(baseFd, &overlay.sectors, buffer, &committed, &failed);
+    commitOverlayMap(baseFd, &overlay.clusters, buffer, &committed, &failed);
+    bool ok = failed == 0;
+    if (fsync(baseFd) < 0) {
+        perror("Error syncing image");
+        ok = false;
     }
+    close(baseFd);
+    free(buffer);
 
-    DirEntry* entries = (DirEntry*) buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool fileFound = false;
+    if (!ok) {
+        printf("Error: Committed %zu of %zu blocks to %s, the overlay is kept\n", committed, committed + failed, imagePath);
+        return false;
+    }
 
-    //search for entry to delete
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00) {
-            break; 
+    //the base now has everything, drop the sidecar contents
+    clearOverlayIndex();
+    if (ftruncate(overlay.indexFd, sizeof(OverlayIndexHeader)) < 0 ||
+        ftruncate(overlay.fd, 0) < 0) {
+        perror("Error truncating overlay file");
+    }
+    printf("Committed %zu blocks to %s\n", committed, imagePath);
+    return true;
+}
+
+//with --ram the image lives in memory, so reads and writes never reach the fd.
+//with --overlay they are routed between the base image and the sidecar
+bool readAt(int fd, void* buffer, size_t count, off_t offset) {
+    if (imageInRam) {
+        if (offset < 0 || (size_t)offset + count > imageMapSize) {
+            errno = EIO;
+            return false;
         }
+        memcpy(buffer, imageMap + offset, count);
+        return true;
+    }
+    if (overlay.fd >= 0) {
+        return overlayRead(fd, buffer, count, offset);
+    }
+    return preadFull(fd, buffer, count, offset);
+}
 
-        if ((unsigned char)entries[i].name[0] == 0xE5) {
-            continue; 
+bool writeAt(int fd, const void* buffer, size_t count, off_t offset) {
+    if (imageInRam) {
+        if (offset < 0 || (size_t)offset + count > imageMapSize) {
+            errno = EIO;
+            return false;
         }
+        memcpy(imageMap + offset, buffer, count);
+        if (count > 0) markImageDirty(offset, count);
+        return true;
+    }
+    if (overlay.fd >= 0) {
+        return overlayWrite(fd, buffer, count, offset);
+    }
+    return pwriteFull(fd, buffer, count, offset);
+}
 
-        char formattedName[12];
-        strncpy(formattedName, entries[i].name, 11);
-        formattedName[11] = '\0';
+//one positional read in a batch
+typedef struct {
+    unsigned char* buffer;
+    size_t count;
+    off_t offset;
+} IoRequest;
 
-        //remove trailing spaces from filename
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
-        }
+#define DEFAULT_QUEUE_DEPTH 32
 
-        //mark the deleted entry as deleted
-        if (strcmp(formattedName, fileName) == 0) {
-            entries[i].name[0] = 0xE5; 
-            fileFound = true;
-            break;
-        }
+//raw io_uring rings, set up by --io=uring. ringFd is -1 when the backend is off
+typedef struct {
+    int ringFd;
+    unsigned int entries;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} IoRing;
+
+IoRing ioRing = { .ringFd = -1 };
+unsigned int ioQueueDepth = DEFAULT_QUEUE_DEPTH;
+
+//create the ring and map its queues. returns false if the kernel doesn't have
+//io_uring (or it is blocked) so the caller can stay on the synchronous path
+bool initIoRing(unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0) {
+        return false;
     }
 
-    //if the file is found, calculate offset and print message
-    if (fileFound) {
-        off_t offset = (context->currentCluster - 2) * bsi->sectorsPerCluster * bsi->bytesPerSector + bsi->rootCluster * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to update directory entry");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing updated directory entry");
-        } else {
-            printf("File removed successfully\n");
+    size_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap && cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+
+    void* sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        close(ringFd);
+        return false;
+    }
+    void* cqRing = sqRing;
+    if (!singleMap) {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+            close(ringFd);
+            return false;
         }
-    } else {
-        printf("Error: File not found.\n");
+    }
+    size_t sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (!singleMap) munmap(cqRing, cqRingSize);
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
+        return false;
     }
 
-    free(buffer);
+    unsigned char* sq = sqRing;
+    unsigned char* cq = cqRing;
+    ioRing.ringFd = ringFd;
+    ioRing.entries = params.sq_entries;
+    ioRing.sqHead = (unsigned int*)(sq + params.sq_off.head);
+    ioRing.sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    ioRing.sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ioRing.sqArray = (unsigned int*)(sq + params.sq_off.array);
+    ioRing.sqes = sqes;
+    ioRing.cqHead = (unsigned int*)(cq + params.cq_off.head);
+    ioRing.cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    ioRing.cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ioRing.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ioRing.sqRing = sqRing;
+    ioRing.sqRingSize = sqRingSize;
+    ioRing.cqRing = singleMap ? NULL : cqRing;
+    ioRing.cqRingSize = cqRingSize;
+    ioRing.sqesSize = sqesSize;
+    return true;
 }
 
-//function to handle rmdir
-void removeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
-    if (strcmp(dirName, ".") == 0 || strcmp(dirName, "..") == 0) {
-        printf("Error: Cannot remove '.' or '..'\n");
+void freeIoRing() {
+    if (ioRing.ringFd < 0) {
         return;
     }
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for directory cluster\n");
+    munmap(ioRing.sqes, ioRing.sqesSize);
+    if (ioRing.cqRing) munmap(ioRing.cqRing, ioRing.cqRingSize);
+    munmap(ioRing.sqRing, ioRing.sqRingSize);
+    close(ioRing.ringFd);
+    memset(&ioRing, 0, sizeof(ioRing));
+    ioRing.ringFd = -1;
+}
+
+//put one read on the submission queue, the caller made sure there is room
+void queueRingRead(int fd, IoRequest* request, unsigned int id) {
+    unsigned int tail = *ioRing.sqTail;
+    unsigned int index = tail & *ioRing.sqMask;
+    struct io_uring_sqe* sqe = &ioRing.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)request->buffer;
+    sqe->len = request->count;
+    sqe->off = request->offset;
+    sqe->user_data = id;
+    ioRing.sqArray[index] = index;
+    __atomic_store_n(ioRing.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+//submit every read at once (up to the queue depth) and reap completions in
+//whatever order they finish. short reads are requeued for the remainder.
+//requests are updated in place as they progress. after an error nothing new is
+//queued, but the reads the kernel already has are still waited for so their
+//buffers are not reused while it may be writing into them
+bool ringReadBatch(int fd, IoRequest* requests, unsigned int count) {
+    unsigned int next = 0;
+    unsigned int outstanding = 0;
+    bool ok = true;
+
+    while ((ok && next < count) || outstanding > 0) {
+        while (ok && next < count && outstanding < ioRing.entries) {
+            queueRingRead(fd, &requests[next], next);
+            next++;
+            outstanding++;
+        }
+
+        //submit whatever the kernel hasn't consumed yet and wait for one completion
+        unsigned int pending = *ioRing.sqTail - __atomic_load_n(ioRing.sqHead, __ATOMIC_ACQUIRE);
+        //EBUSY and EAGAIN only ask for completions to be reaped first
+        if (syscall(__NR_io_uring_enter, ioRing.ringFd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            int error = errno;
+            //take back the entries the kernel never consumed, they will not complete
+            unsigned int unsubmitted = *ioRing.sqTail - __atomic_load_n(ioRing.sqHead, __ATOMIC_ACQUIRE);
+            if (unsubmitted > 0) {
+                __atomic_store_n(ioRing.sqTail, *ioRing.sqTail - unsubmitted, __ATOMIC_RELEASE);
+                outstanding -= unsubmitted;
+            } else {
+                //nothing left to submit and waiting failed, so the reads in flight
+                //can't be reaped. closing the ring is the only way to stop them
+                errno = error;
+                perror("Error waiting for reads");
+                freeIoRing();
+                return false;
+            }
+            if (ok) {
+                errno = error;
+                perror("Error submitting reads");
+                ok = false;
+            }
+            continue;
+        }
+
+        unsigned int head = *ioRing.cqHead;
+        unsigned int tail = __atomic_load_n(ioRing.cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &ioRing.cqes[head & *ioRing.cqMask];
+            IoRequest* request = &requests[cqe->user_data];
+            int result = cqe->res;
+            head++;
+            outstanding--;
+
+            if (result == -EINTR || result == -EAGAIN) {
+                result = 0;
+            } else if (result <= 0) {
+                errno = result < 0 ? -result : EIO;
+                perror("Error reading cluster");
+                ok = false;
+                continue;
+            }
+            request->buffer += result;
+            request->offset += result;
+            request->count -= result;
+            if (request->count > 0 && ok) {
+                //short read, the queue has room since this entry just completed
+                queueRingRead(fd, request, cqe->user_data);
+                outstanding++;
+            }
+        }
+        __atomic_store_n(ioRing.cqHead, head, __ATOMIC_RELEASE);
+    }
+    return ok;
+}
+
+//read a batch of requests. goes through io_uring when it is set up,
+//otherwise one pread at a time
+bool readBatch(int fd, IoRequest* requests, unsigned int count) {
+    if (ioRing.ringFd >= 0 && !imageInRam && overlay.fd < 0) {
+        return ringReadBatch(fd, requests, count);
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        if (!readAt(fd, requests[i].buffer, requests[i].count, requests[i].offset)) {
+            perror("Error reading cluster");
+            return false;
+        }
+    }
+    return true;
+}
+
+#define SHARED_MAGIC 0x53544146u         //"FATS"
+#define DEFAULT_SHARED_SLOTS 4096
+
+//opt-in cache shared by every filesys process on the same image: a POSIX shared
+//memory segment named after the image path and inode. it holds a copy of the FAT
+//when the whole FAT fits under the FAT cache cap, and a direct-mapped table of
+//clean clusters. writers update it along with the image and bump generation so
+//other processes drop their private caches before their next command
+typedef struct {
+    uint32_t magic;                //set last by the creator
+    uint32_t clusterSize;
+    uint64_t fatBytes;             //0 when the FAT isn't shared
+    uint32_t numSlots;
+    uint32_t fatValid;
+    uint64_t generation;
+    struct timespec imageModified; //image mtime after the last write through the segment
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;          //process-shared and robust
+} SharedHeader;
+
+typedef struct {
+    SharedHeader* header;          //NULL when the shared cache is off
+    unsigned char* fat;
+    uint32_t* slotClusters;        //cluster held by each slot, 0 when empty
+    unsigned char* data;
+    size_t size;
+    uint64_t seenGeneration;       //last generation this process caught up with
+    int fd;                        //kept open with a shared flock while attached
+} SharedCache;
+
+SharedCache sharedCache;
+unsigned int sharedSlots = 0;     //--shared-cache, 0 means off
+
+//a process that died holding the lock may have left a half-copied slot or FAT,
+//and may have written the image without bumping the generation. the slots are
+//emptied, the FAT copy is marked invalid and the generation bumped, so every
+//attached process drops its caches and reads the FAT from the image again
+void sharedLock() {
+    if (pthread_mutex_lock(&sharedCache.header->lock) == EOWNERDEAD) {
+        memset(sharedCache.slotClusters, 0, sharedCache.header->numSlots * sizeof(uint32_t));
+        sharedCache.header->fatValid = 0;
+        __atomic_store_n(&sharedCache.header->generation, sharedCache.header->generation + 1, __ATOMIC_RELEASE);
+        pthread_mutex_consistent(&sharedCache.header->lock);
+    }
+}
+
+void sharedUnlock() {
+    pthread_mutex_unlock(&sharedCache.header->lock);
+}
+
+uint64_t sharedGeneration() {
+    return __atomic_load_n(&sharedCache.header->generation, __ATOMIC_ACQUIRE);
+}
+
+//segment name from an FNV-1a hash of the resolved path plus the inode
+void sharedCacheName(const char* imagePath, ino_t inode, char* name, size_t length) {
+    char resolved[PATH_MAX];
+    const char* path = realpath(imagePath, resolved) ? resolved : imagePath;
+    uint64_t hash = 14695981039346656037ull;
+    for (const char* c = path; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+    }
+    snprintf(name, length, "/filesys-%016llx-%llu", (unsigned long long)hash, (unsigned long long)inode);
+}
+
+//true while name still refers to the segment open on fd. it is unlinked when a
+//process recreates it, and one opened just before that must not be used
+bool sharedStillLinked(const char* name, int fd) {
+    struct stat opened, current;
+    int nameFd = shm_open(name, O_RDWR, 0);
+    if (nameFd < 0) {
+        return false;
+    }
+    bool same = fstat(fd, &opened) == 0 && fstat(nameFd, &current) == 0 && opened.st_ino == current.st_ino;
+    close(nameFd);
+    return same;
+}
+
+//attach to the image's segment, creating it if this is the first process. later
+//processes take the layout the creator chose. every attached process holds a
+//shared flock on the segment, so a segment that doesn't match this image (the
+//image was recreated, or the cluster size or FAT changed) is unlinked and made
+//again when an exclusive lock shows nobody else is using it
+bool initSharedCache(const char* imagePath, struct stat* st, BootSectorInfo* bsi) {
+    char name[96];
+    sharedCacheName(imagePath, st->st_ino, name, sizeof(name));
+    uint64_t fatBytes = (uint64_t)bsi->sectorsPerFAT << bsi->sectorShift;
+    if (fatBytes > fatCacheLimit) fatBytes = 0;
+    size_t headerBytes = (sizeof(SharedHeader) + 63) & ~(size_t)63;
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        size_t size = headerBytes + fatBytes + (size_t)sharedSlots * (sizeof(uint32_t) + clusterBytes(bsi));
+        bool creator = true;
+        int sfd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (sfd < 0 && errno == EEXIST) {
+            creator = false;
+            sfd = shm_open(name, O_RDWR, 0);
+        }
+        if (sfd < 0) {
+            perror("Error opening shared cache");
+            return false;
+        }
+        if (flock(sfd, LOCK_SH) != 0) {
+            perror("Error locking shared cache");
+            close(sfd);
+            return false;
+        }
+        if (!creator && !sharedStillLinked(name, sfd)) {
+            close(sfd);
+            continue;
+        }
+
+        struct stat segment;
+        if (creator) {
+            if (ftruncate(sfd, size) != 0) {
+                perror("Error sizing shared cache");
+                close(sfd);
+                shm_unlink(name);
+                return false;
+            }
+        } else {
+            //the creator may not have sized it yet
+            for (int tries = 0; fstat(sfd, &segment) == 0 && segment.st_size == 0 && tries < 1000; tries++) {
+                usleep(1000);
+            }
+            size = segment.st_size;
+        }
+
+        void* base = size >= headerBytes ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0) : MAP_FAILED;
+        if (base == MAP_FAILED) {
+            if (size >= headerBytes) {
+                perror("Error mapping shared cache");
+                close(sfd);
+                return false;
+            }
+            base = NULL;
+        }
+        SharedHeader* header = base;
+
+        if (creator) {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&header->lock, &attr);
+            pthread_mutexattr_destroy(&attr);
+            header->clusterSize = clusterBytes(bsi);
+            header->fatBytes = fatBytes;
+            header->numSlots = sharedSlots;
+            header->imageModified = st->st_mtim;
+            __atomic_store_n(&header->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+        } else if (header) {
+            for (int tries = 0; __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC && tries < 1000; tries++) {
+                usleep(1000);
+            }
+        }
+
+        //a segment left by an image with a different layout, or by a creator that
+        //died before setting it up, is replaced unless another process is using it
+        uint64_t expectedFat = (uint64_t)bsi->sectorsPerFAT << bsi->sectorShift;
+        if (!header || header->magic != SHARED_MAGIC || header->clusterSize != clusterBytes(bsi) ||
+            (header->fatBytes && header->fatBytes != expectedFat) ||
+            headerBytes + header->fatBytes + (size_t)header->numSlots * (sizeof(uint32_t) + header->clusterSize) > size) {
+            if (base) munmap(base, size);
+            if (flock(sfd, LOCK_EX | LOCK_NB) != 0) {
+                printf("Error: Shared cache %s doesn't match this image and another process is using it\n", name);
+                close(sfd);
+                return false;
+            }
+            printf("Shared cache %s doesn't match this image, recreating it\n", name);
+            shm_unlink(name);
+            close(sfd);
+            continue;
+        }
+
+        sharedCache.header = header;
+        sharedCache.size = size;
+        sharedCache.fd = sfd;
+        sharedCache.fat = (unsigned char*)base + headerBytes;
+        sharedCache.slotClusters = (uint32_t*)(sharedCache.fat + header->fatBytes);
+        sharedCache.data = (unsigned char*)(sharedCache.slotClusters + header->numSlots);
+
+        //the image was changed by something other than filesys, nothing cached is trusted
+        sharedLock();
+        if (header->imageModified.tv_sec != st->st_mtim.tv_sec || header->imageModified.tv_nsec != st->st_mtim.tv_nsec) {
+            memset(sharedCache.slotClusters, 0, header->numSlots * sizeof(uint32_t));
+            header->fatValid = 0;
+            header->imageModified = st->st_mtim;
+            header->generation++;
+        }
+        sharedCache.seenGeneration = header->generation;
+        sharedUnlock();
+        return true;
+    }
+    printf("Error: Shared cache %s keeps being replaced\n", name);
+    return false;
+}
+
+void freeSharedCache() {
+    if (sharedCache.header) {
+        munmap(sharedCache.header, sharedCache.size);
+        close(sharedCache.fd);
+    }
+    memset(&sharedCache, 0, sizeof(sharedCache));
+}
+
+//copy a cluster out of the segment if it holds it
+bool sharedReadCluster(uint32_t clusterNum, unsigned char* dest) {
+    if (!sharedCache.header || !sharedCache.header->numSlots) {
+        return false;
+    }
+    uint32_t slot = clusterNum % sharedCache.header->numSlots;
+    sharedLock();
+    bool hit = sharedCache.slotClusters[slot] == clusterNum;
+    if (hit) {
+        memcpy(dest, sharedCache.data + (size_t)slot * sharedCache.header->clusterSize, sharedCache.header->clusterSize);
+        sharedCache.header->hits++;
+    } else {
+        sharedCache.header->misses++;
+    }
+    sharedUnlock();
+    return hit;
+}
+
+//publish a cluster read from the image. generation is the one seen before the
+//read, if a writer came in between the copy may be stale and is dropped
+void sharedStoreCluster(uint32_t clusterNum, const unsigned char* src, uint64_t generation) {
+    if (!sharedCache.header || !sharedCache.header->numSlots) {
+        return;
+    }
+    uint32_t slot = clusterNum % sharedCache.header->numSlots;
+    sharedLock();
+    if (sharedCache.header->generation == generation) {
+        memcpy(sharedCache.data + (size_t)slot * sharedCache.header->clusterSize, src, sharedCache.header->clusterSize);
+        sharedCache.slotClusters[slot] = clusterNum;
+    }
+    sharedUnlock();
+}
+
+//this process changed the image, called with the lock held. if nobody else
+//wrote since we last caught up our private caches stay valid
+void sharedBumpGeneration(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        sharedCache.header->imageModified = st.st_mtim;
+    }
+    if (sharedCache.header->generation == sharedCache.seenGeneration) {
+        sharedCache.seenGeneration++;
+    }
+    __atomic_store_n(&sharedCache.header->generation, sharedCache.header->generation + 1, __ATOMIC_RELEASE);
+}
+
+//a cluster was written to the image, keep the segment's copy in step
+void sharedWroteCluster(int fd, uint32_t clusterNum, const unsigned char* src) {
+    if (!sharedCache.header) {
+        return;
+    }
+    sharedLock();
+    if (sharedCache.header->numSlots) {
+        uint32_t slot = clusterNum % sharedCache.header->numSlots;
+        memcpy(sharedCache.data + (size_t)slot * sharedCache.header->clusterSize, src, sharedCache.header->clusterSize);
+        sharedCache.slotClusters[slot] = clusterNum;
+    }
+    sharedBumpGeneration(fd);
+    sharedUnlock();
+}
+
+//copy part of the FAT out of the segment once some process has published it
+bool sharedReadFat(void* dest, size_t bytes, uint64_t offset) {
+    if (!sharedCache.header || !sharedCache.header->fatValid || offset + bytes > sharedCache.header->fatBytes) {
+        return false;
+    }
+    sharedLock();
+    bool valid = sharedCache.header->fatValid;
+    if (valid) {
+        memcpy(dest, sharedCache.fat + offset, bytes);
+    }
+    sharedUnlock();
+    return valid;
+}
+
+//publish the whole FAT after reading it from the image
+void sharedStoreFat(const void* src, uint64_t bytes, uint64_t generation) {
+    if (!sharedCache.header || bytes != sharedCache.header->fatBytes) {
+        return;
+    }
+    sharedLock();
+    if (!sharedCache.header->fatValid && sharedCache.header->generation == generation) {
+        memcpy(sharedCache.fat, src, bytes);
+        sharedCache.header->fatValid = 1;
+    }
+    sharedUnlock();
+}
+
+//FAT sectors were written to the image
+void sharedWroteFat(int fd, const void* src, size_t bytes, uint64_t offset) {
+    if (!sharedCache.header) {
+        return;
+    }
+    sharedLock();
+    if (sharedCache.header->fatValid && offset + bytes <= sharedCache.header->fatBytes) {
+        memcpy(sharedCache.fat + offset, src, bytes);
+    }
+    sharedBumpGeneration(fd);
+    sharedUnlock();
+}
+
+//map the whole image shared so writes land in the file
+bool mapImage(int fd, BootSectorInfo* bsi) {
+    mapPageSize = sysconf(_SC_PAGESIZE);
+    size_t numPages = (bsi->sizeOfImage + mapPageSize - 1) / mapPageSize;
+    mapDirtyPages = calloc((numPages + 7) / 8, 1);
+    if (!mapDirtyPages) {
+        printf("Failed to allocate memory for mapping\n");
+        return false;
+    }
+
+    void* map = mmap(NULL, bsi->sizeOfImage, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping image");
+        free(mapDirtyPages);
+        mapDirtyPages = NULL;
+        return false;
+    }
+    imageMap = map;
+    imageMapSize = bsi->sizeOfImage;
+    return true;
+}
+
+//push every run of dirty host pages to the file: msync for a mapping,
+//pwrite for a RAM image
+bool flushImageMap(int fd) {
+    if (!imageMap) {
+        return true;
+    }
+
+    size_t numPages = (imageMapSize + mapPageSize - 1) / mapPageSize;
+    size_t page = 0;
+    bool ok = true;
+    while (page < numPages) {
+        if (!BIT_TEST(mapDirtyPages, page)) {
+            page++;
+            continue;
+        }
+
+        size_t runEnd = page;
+        while (runEnd < numPages && BIT_TEST(mapDirtyPages, runEnd)) {
+            BIT_CLEAR(mapDirtyPages, runEnd);
+            runEnd++;
+        }
+
+        size_t length = (runEnd - page) * mapPageSize;
+        if (page * mapPageSize + length > imageMapSize) {
+            length = imageMapSize - page * mapPageSize;
+        }
+        if (imageInRam) {
+            if (!pwriteFull(fd, imageMap + page * mapPageSize, length, page * mapPageSize)) {
+                perror("Error writing image");
+                ok = false;
+            }
+        } else if (msync(imageMap + page * mapPageSize, length, MS_SYNC) < 0) {
+            perror("Error syncing image");
+            ok = false;
+        }
+        page = runEnd;
+    }
+    return ok;
+}
+
+//copy the whole image into an anonymous buffer for --ram
+bool loadImageIntoRam(int fd, BootSectorInfo* bsi) {
+    mapPageSize = sysconf(_SC_PAGESIZE);
+    size_t numPages = (bsi->sizeOfImage + mapPageSize - 1) / mapPageSize;
+    mapDirtyPages = calloc((numPages + 7) / 8, 1);
+    if (!mapDirtyPages) {
+        printf("Failed to allocate memory for RAM image\n");
+        return false;
+    }
+
+    void* ram = mmap(NULL, bsi->sizeOfImage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram == MAP_FAILED) {
+        perror("Error allocating RAM image");
+        free(mapDirtyPages);
+        mapDirtyPages = NULL;
+        return false;
+    }
+    if (!preadFull(fd, ram, bsi->sizeOfImage, 0)) {
+        perror("Error loading image into RAM");
+        munmap(ram, bsi->sizeOfImage);
+        free(mapDirtyPages);
+        mapDirtyPages = NULL;
+        return false;
+    }
+
+    imageMap = ram;
+    imageMapSize = bsi->sizeOfImage;
+    imageInRam = true;
+    return true;
+}
+
+void unmapImage() {
+    if (imageMap) {
+        munmap(imageMap, imageMapSize);
+    }
+    imageInRam = false;
+    free(mapDirtyPages);
+    imageMap = NULL;
+    mapDirtyPages = NULL;
+}
+
+//check that a cluster lies inside the mapping
+bool clusterInMap(unsigned int clusterNum, BootSectorInfo* bsi) {
+    size_t clusterSize = clusterBytes(bsi);
+    off_t offset = clusterOffset(clusterNum, bsi);
+    if (clusterNum < 2 || offset < 0 || (size_t)offset + clusterSize > imageMapSize) {
+        fprintf(stderr, "Invalid cluster number: %u\n", clusterNum);
+        return false;
+    }
+    return true;
+}
+
+//read a cluster straight from the image (or the mapping), bypassing the cache
+bool readClusterFromImage(int fd, unsigned int clusterNum, unsigned char* buffer, BootSectorInfo* bsi) {
+    off_t offset = clusterOffset(clusterNum, bsi);
+
+    if (imageMap) {
+        if (!clusterInMap(clusterNum, bsi)) {
+            return false;
+        }
+        memcpy(buffer, imageMap + offset, clusterBytes(bsi));
+        return true;
+    }
+
+    //another process may already have read it
+    if (sharedReadCluster(clusterNum, buffer)) {
+        return true;
+    }
+    uint64_t generation = sharedCache.header ? sharedGeneration() : 0;
+
+    //read the cluster
+    if (!readAt(fd, buffer, clusterBytes(bsi), offset)) {
+        perror("Error reading cluster");
+        return false;
+    }
+
+    sharedStoreCluster(clusterNum, buffer, generation);
+    return true;
+}
+
+//write a whole cluster straight to the image (or the mapping), bypassing the cache
+bool writeClusterToImage(int fd, unsigned int clusterNum, const unsigned char* buffer, BootSectorInfo* bsi) {
+    size_t clusterSize = clusterBytes(bsi);
+    off_t offset = clusterOffset(clusterNum, bsi);
+
+    if (imageMap) {
+        if (!clusterInMap(clusterNum, bsi)) {
+            return false;
+        }
+        memcpy(imageMap + offset, buffer, clusterSize);
+        markImageDirty(offset, clusterSize);
+        return true;
+    }
+
+    if (!writeAt(fd, buffer, clusterSize, offset)) {
+        perror("Error writing cluster");
+        return false;
+    }
+    sharedWroteCluster(fd, clusterNum, buffer);
+    return true;
+}
+
+#define DEFAULT_CLUSTER_CACHE_SLOTS 256
+#define READ_CHUNK_BYTES (1024 * 1024)     //most a read command buffers before printing
+
+//one cached cluster. pinned slots are borrowed by a caller and can't be evicted
+typedef struct CacheSlot {
+    unsigned int cluster;
+    bool valid;
+    bool dirty;
+    bool isProtected;              //which of the two LRU lists the slot is on
+    bool disabled;                 //parked by the memory budget, on no list
+    bool indexed;                  //belongs to a directory with a name index
+    bool prefetched;               //loaded ahead of use and not referenced since
+    int pins;
+    time_t dirtySince;             //when the slot went from clean to dirty
+    struct CacheSlot* prev;        //LRU list, head is the most recently used
+    struct CacheSlot* next;
+    struct CacheSlot* hashNext;
+} CacheSlot;
+
+typedef struct {
+    CacheSlot* head;
+    CacheSlot* tail;
+    unsigned int count;
+} SlotList;
+
+//bounded write-back cache of clusters keyed by cluster number
+//dirty slots are written back when evicted or at exit.
+//replacement is segmented LRU so a big sequential read can't flush directory
+//clusters: data clusters enter the probation list and only move to the protected
+//list when hit again, directory clusters go straight to protected. victims come
+//from probation first, so a scan only ever recycles its own clusters. a cluster
+//loaded by read-ahead hasn't been referenced yet, its first hit keeps it on probation
+//capacity slots are reserved up front but only active of them are in use,
+//the memory budget grows and shrinks active
+typedef struct {
+    CacheSlot* slots;
+    unsigned char* data;           //slot i owns data + i * clusterSize
+    CacheSlot** buckets;
+    unsigned int capacity;
+    unsigned int active;
+    unsigned int numBuckets;
+    unsigned int protectedMax;
+    size_t clusterSize;
+    SlotList probation;
+    SlotList protectedList;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long metadataHits;
+    unsigned long long metadataMisses;
+    unsigned long long writebacks;
+    unsigned long long readAheads;     //clusters loaded by read-ahead
+} ClusterCache;
+
+ClusterCache clusterCache;
+unsigned int clusterCacheSlots = DEFAULT_CLUSTER_CACHE_SLOTS;
+unsigned long long memoryBudget = 0;    //--mem-budget in bytes, 0 means no global limit
+
+unsigned char* slotData(CacheSlot* slot) {
+    return clusterCache.data + (size_t)(slot - clusterCache.slots) * clusterCache.clusterSize;
+}
+
+SlotList* slotList(CacheSlot* slot) {
+    return slot->isProtected ? &clusterCache.protectedList : &clusterCache.probation;
+}
+
+void lruUnlink(CacheSlot* slot) {
+    SlotList* list = slotList(slot);
+    if (slot->prev) slot->prev->next = slot->next;
+    else list->head = slot->next;
+    if (slot->next) slot->next->prev = slot->prev;
+    else list->tail = slot->prev;
+    slot->prev = slot->next = NULL;
+    list->count--;
+}
+
+void lruPushFront(CacheSlot* slot, bool isProtected) {
+    slot->isProtected = isProtected;
+    SlotList* list = slotList(slot);
+    slot->prev = NULL;
+    slot->next = list->head;
+    if (list->head) list->head->prev = slot;
+    list->head = slot;
+    if (!list->tail) list->tail = slot;
+    list->count++;
+}
+
+//move a slot to the front of the protected list. if that overflows it, the
+//oldest protected slot drops back to the front of probation
+void promoteSlot(CacheSlot* slot) {
+    lruUnlink(slot);
+    lruPushFront(slot, true);
+    if (clusterCache.protectedList.count > clusterCache.protectedMax) {
+        CacheSlot* demoted = clusterCache.protectedList.tail;
+        lruUnlink(demoted);
+        lruPushFront(demoted, false);
+    }
+}
+
+//least recently used unpinned slot of a list
+CacheSlot* lruVictim(SlotList* list) {
+    CacheSlot* slot = list->tail;
+    while (slot && slot->pins > 0) {
+        slot = slot->prev;
+    }
+    return slot;
+}
+
+CacheSlot* hashFind(unsigned int cluster) {
+    CacheSlot* slot = clusterCache.buckets[cluster % clusterCache.numBuckets];
+    while (slot && slot->cluster != cluster) {
+        slot = slot->hashNext;
+    }
+    return slot;
+}
+
+void hashInsert(CacheSlot* slot) {
+    CacheSlot** bucket = &clusterCache.buckets[slot->cluster % clusterCache.numBuckets];
+    slot->hashNext = *bucket;
+    *bucket = slot;
+}
+
+void dirIndexEvicted(unsigned int clusterNum);
+
+//every eviction path comes through here, a directory's name index goes with its first cluster
+void hashRemove(CacheSlot* slot) {
+    CacheSlot** link = &clusterCache.buckets[slot->cluster % clusterCache.numBuckets];
+    while (*link && *link != slot) {
+        link = &(*link)->hashNext;
+    }
+    if (*link) *link = slot->hashNext;
+    slot->hashNext = NULL;
+    if (slot->indexed) {
+        slot->indexed = false;
+        dirIndexEvicted(slot->cluster);
+    }
+}
+
+void setProtectedMax() {
+    clusterCache.protectedMax = clusterCache.active - clusterCache.active / 4;
+    if (clusterCache.protectedMax < 1) clusterCache.protectedMax = 1;
+}
+
+//allocate the slots, every active slot starts out empty on the LRU list.
+//with a memory budget enough address space is reserved for the cache to grow
+//into the whole budget, untouched slots cost no memory
+bool initClusterCache(BootSectorInfo* bsi) {
+    if (clusterCacheSlots == 0 || imageMap) {
+        //the mapping already serves as the cache
+        return true;
+    }
+
+    clusterCache.clusterSize = clusterBytes(bsi);
+    unsigned int reserved = clusterCacheSlots;
+    if (memoryBudget / clusterCache.clusterSize > reserved) {
+        reserved = memoryBudget / clusterCache.clusterSize;
+    }
+
+    clusterCache.numBuckets = reserved * 2;
+    clusterCache.slots = calloc(reserved, sizeof(CacheSlot));
+    clusterCache.buckets = calloc(clusterCache.numBuckets, sizeof(CacheSlot*));
+    void* data = mmap(NULL, (size_t)reserved * clusterCache.clusterSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (!clusterCache.slots || !clusterCache.buckets || data == MAP_FAILED) {
+        printf("Failed to allocate memory for cluster cache\n");
+        free(clusterCache.slots);
+        free(clusterCache.buckets);
+        if (data != MAP_FAILED) munmap(data, (size_t)reserved * clusterCache.clusterSize);
+        memset(&clusterCache, 0, sizeof(clusterCache));
+        return false;
+    }
+
+    clusterCache.data = data;
+    clusterCache.capacity = reserved;
+    clusterCache.active = clusterCacheSlots < reserved ? clusterCacheSlots : reserved;
+    setProtectedMax();
+    for (unsigned int i = 0; i < clusterCache.capacity; i++) {
+        if (i < clusterCache.active) {
+            lruPushFront(&clusterCache.slots[i], false);
+        } else {
+            clusterCache.slots[i].disabled = true;
+        }
+    }
+    return true;
+}
+
+void markSlotDirty(CacheSlot* slot) {
+    if (!slot->dirty) {
+        slot->dirty = true;
+        slot->dirtySince = monotonicSeconds();
+    }
+}
+
+bool writeBackSlot(int fd, CacheSlot* slot, BootSectorInfo* bsi) {
+    if (!slot->valid || !slot->dirty) {
+        return true;
+    }
+    if (!writeClusterToImage(fd, slot->cluster, slotData(slot), bsi)) {
+        return false;
+    }
+    slot->dirty = false;
+    clusterCache.writebacks++;
+    return true;
+}
+
+//find a cluster in the cache. on a miss the least recently used unpinned slot is
+//written back if dirty and reused. load is false when the caller will overwrite
+//the whole cluster, so there is no point reading it first. metadata marks
+//directory clusters, which skip probation
+CacheSlot* cacheLookup(int fd, unsigned int clusterNum, bool load, bool metadata, BootSectorInfo* bsi) {
+    CacheSlot* slot = hashFind(clusterNum);
+    if (slot) {
+        clusterCache.hits++;
+        if (metadata) clusterCache.metadataHits++;
+        if (slot->prefetched && !metadata) {
+            //the first real reference to a read-ahead cluster
+            lruUnlink(slot);
+            lruPushFront(slot, false);
+        } else {
+            promoteSlot(slot);
+        }
+        slot->prefetched = false;
+        return slot;
+    }
+
+    clusterCache.misses++;
+    if (metadata) clusterCache.metadataMisses++;
+    slot = lruVictim(&clusterCache.probation);
+    if (!slot) {
+        slot = lruVictim(&clusterCache.protectedList);
+    }
+    if (!slot) {
+        printf("Error: All cluster cache slots are in use\n");
+        return NULL;
+    }
+    if (!writeBackSlot(fd, slot, bsi)) {
+        return NULL;
+    }
+    if (slot->valid) {
+        hashRemove(slot);
+        slot->valid = false;
+    }
+
+    if (load && !readClusterFromImage(fd, clusterNum, slotData(slot), bsi)) {
+        return NULL;
+    }
+
+    slot->cluster = clusterNum;
+    slot->valid = true;
+    slot->dirty = false;
+    slot->prefetched = false;
+    hashInsert(slot);
+    if (metadata) {
+        promoteSlot(slot);
+    } else {
+        lruUnlink(slot);
+        lruPushFront(slot, false);
+    }
+    return slot;
+}
+
+//load a set of file clusters into the cache with batched reads so they are all in
+//flight at once instead of one after another. clusters already cached are skipped,
+//and a batch never claims more than half the cache
+bool prefetchClusters(int fd, const unsigned int* clusters, unsigned int count, BootSectorInfo* bsi) {
+    if (!clusterCache.capacity || count == 0) {
+        return true;
+    }
+
+    unsigned int maxBatch = clusterCache.active / 2;
+    if (maxBatch < 1) maxBatch = 1;
+    IoRequest* requests = malloc(maxBatch * sizeof(IoRequest));
+    CacheSlot** claimed = malloc(maxBatch * sizeof(CacheSlot*));
+    if (!requests || !claimed) {
+        free(requests);
+        free(claimed);
+        return false;
+    }
+
+    bool ok = true;
+    unsigned int next = 0;
+    while (ok && next < count) {
+        unsigned int batch = 0;
+        uint64_t generation = sharedCache.header ? sharedGeneration() : 0;
+        while (next < count && batch < maxBatch) {
+            unsigned int cluster = clusters[next++];
+            if (hashFind(cluster)) continue;
+
+            CacheSlot* slot = cacheLookup(fd, cluster, false, false, bsi);
+            if (!slot) break;
+            slot->prefetched = true;
+            if (sharedReadCluster(cluster, slotData(slot))) continue;
+            slot->pins++;
+            claimed[batch] = slot;
+            requests[batch].buffer = slotData(slot);
+            requests[batch].count = clusterCache.clusterSize;
+            requests[batch].offset = clusterOffset(cluster, bsi);
+            batch++;
+        }
+
+        ok = readBatch(fd, requests, batch);
+        for (unsigned int i = 0; i < batch; i++) {
+            claimed[i]->pins--;
+            if (ok) {
+                sharedStoreCluster(claimed[i]->cluster, slotData(claimed[i]), generation);
+            } else {
+                //the slot was claimed without data, don't let anyone hit on it
+                hashRemove(claimed[i]);
+                claimed[i]->valid = false;
+            }
+        }
+    }
+
+    free(requests);
+    free(claimed);
+    return ok;
+}
+
+//find the slot that owns a pointer handed out by borrowCluster, NULL if not cached
+CacheSlot* slotForData(const unsigned char* data) {
+    if (!clusterCache.capacity || data < clusterCache.data ||
+        data >= clusterCache.data + (size_t)clusterCache.capacity * clusterCache.clusterSize) {
+        return NULL;
+    }
+    return &clusterCache.slots[(data - clusterCache.data) / clusterCache.clusterSize];
+}
+
+//write every dirty slot back to the image
+bool flushClusterCache(int fd, BootSectorInfo* bsi) {
+    bool ok = true;
+    for (unsigned int i = 0; i < clusterCache.capacity; i++) {
+        if (!writeBackSlot(fd, &clusterCache.slots[i], bsi)) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+//grow or shrink the number of active slots. shrinking evicts least recently used
+//slots, probation first, writes them back and returns their memory
+bool resizeClusterCache(int fd, unsigned int target, BootSectorInfo* bsi) {
+    if (!clusterCache.capacity) {
+        return true;
+    }
+    if (target < 1) target = 1;
+    if (target > clusterCache.capacity) target = clusterCache.capacity;
+
+    for (unsigned int i = 0; i < clusterCache.capacity && clusterCache.active < target; i++) {
+        CacheSlot* slot = &clusterCache.slots[i];
+        if (slot->disabled) {
+            slot->disabled = false;
+            lruPushFront(slot, false);
+            clusterCache.active++;
+        }
+    }
+
+    while (clusterCache.active > target) {
+        CacheSlot* slot = lruVictim(&clusterCache.probation);
+        if (!slot) slot = lruVictim(&clusterCache.protectedList);
+        if (!slot || !writeBackSlot(fd, slot, bsi)) {
+            break;
+        }
+        if (slot->valid) {
+            hashRemove(slot);
+            slot->valid = false;
+        }
+        lruUnlink(slot);
+        slot->disabled = true;
+        clusterCache.active--;
+
+        //hand whole pages inside the slot back to the kernel
+        uintptr_t start = (uintptr_t)slotData(slot);
+        uintptr_t end = start + clusterCache.clusterSize;
+        uintptr_t pageStart = (start + mapPageSize - 1) & ~(uintptr_t)(mapPageSize - 1);
+        uintptr_t pageEnd = end & ~(uintptr_t)(mapPageSize - 1);
+        if (pageEnd > pageStart) {
+            madvise((void*)pageStart, pageEnd - pageStart, MADV_DONTNEED);
+        }
+    }
+
+    setProtectedMax();
+    while (clusterCache.protectedList.count > clusterCache.protectedMax) {
+        CacheSlot* demoted = clusterCache.protectedList.tail;
+        lruUnlink(demoted);
+        lruPushFront(demoted, false);
+    }
+    return clusterCache.active == target;
+}
+
+void freeClusterCache() {
+    free(clusterCache.slots);
+    if (clusterCache.data) {
+        munmap(clusterCache.data, (size_t)clusterCache.capacity * clusterCache.clusterSize);
+    }
+    free(clusterCache.buckets);
+    memset(&clusterCache, 0, sizeof(clusterCache));
+}
+
+//handle the cachestats command
+void printCacheStats() {
+    if (!clusterCache.capacity) {
+        printf("Cluster cache disabled\n");
+        return;
+    }
+
+    unsigned int used = 0;
+    unsigned int dirty = 0;
+    for (unsigned int i = 0; i < clusterCache.capacity; i++) {
+        if (clusterCache.slots[i].valid) used++;
+        if (clusterCache.slots[i].valid && clusterCache.slots[i].dirty) dirty++;
+    }
+
+    unsigned long long lookups = clusterCache.hits + clusterCache.misses;
+    unsigned long long metadataLookups = clusterCache.metadataHits + clusterCache.metadataMisses;
+    printf("Slots: %u used of %u (%u dirty)\n", used, clusterCache.active, dirty);
+    printf("Protected: %u, Probation: %u\n", clusterCache.protectedList.count, clusterCache.probation.count);
+    printf("Hits: %llu\n", clusterCache.hits);
+    printf("Misses: %llu\n", clusterCache.misses);
+    printf("Hit rate: %.1f%%\n", lookups ? 100.0 * clusterCache.hits / lookups : 0.0);
+    printf("Metadata hit rate: %.1f%% (%llu of %llu)\n",
+           metadataLookups ? 100.0 * clusterCache.metadataHits / metadataLookups : 0.0,
+           clusterCache.metadataHits, metadataLookups);
+    printf("Write-backs: %llu\n", clusterCache.writebacks);
+    printf("Read-ahead clusters: %llu\n", clusterCache.readAheads);
+    if (sharedCache.header) {
+        printf("Shared cache: %u slots, %llu hits, %llu misses, generation %llu\n", sharedCache.header->numSlots,
+               (unsigned long long)sharedCache.header->hits, (unsigned long long)sharedCache.header->misses,
+               (unsigned long long)sharedGeneration());
+    }
+}
+
+//read data from a cluster and load it into memory buffer
+bool readCluster(int fd, unsigned int clusterNum, unsigned char* buffer, BootSectorInfo* bsi) {
+    if (!clusterCache.capacity) {
+        return readClusterFromImage(fd, clusterNum, buffer, bsi);
+    }
+
+    CacheSlot* slot = cacheLookup(fd, clusterNum, true, true, bsi);
+    if (!slot) {
+        return false;
+    }
+    memcpy(buffer, slotData(slot), clusterCache.clusterSize);
+    return true;
+}
+
+//write a whole cluster, the cache holds it dirty until it is evicted or flushed
+bool writeCluster(int fd, unsigned int clusterNum, const unsigned char* buffer, BootSectorInfo* bsi) {
+    if (!clusterCache.capacity) {
+        return writeClusterToImage(fd, clusterNum, buffer, bsi);
+    }
+
+    CacheSlot* slot = cacheLookup(fd, clusterNum, false, true, bsi);
+    if (!slot) {
+        return false;
+    }
+    memcpy(slotData(slot), buffer, clusterCache.clusterSize);
+    markSlotDirty(slot);
+    return true;
+}
+
+//get read-only access to a cluster. with --mmap this points straight into the
+//mapping, with the cluster cache it is the pinned slot, otherwise a private copy.
+//hand it back with releaseCluster. metadata is true for directory clusters
+const unsigned char* borrowClusterAs(int fd, unsigned int clusterNum, bool metadata, BootSectorInfo* bsi) {
+    if (imageMap) {
+        if (!clusterInMap(clusterNum, bsi)) {
+            return NULL;
+        }
+        return imageMap + clusterOffset(clusterNum, bsi);
+    }
+
+    if (clusterCache.capacity) {
+        CacheSlot* slot = cacheLookup(fd, clusterNum, true, metadata, bsi);
+        if (!slot) {
+            return NULL;
+        }
+        slot->pins++;
+        return slotData(slot);
+    }
+
+    unsigned char* buffer = malloc(clusterBytes(bsi));
+    if (!buffer) {
+        printf("Failed to allocate memory for reading cluster\n");
+        return NULL;
+    }
+    if (!readClusterFromImage(fd, clusterNum, buffer, bsi)) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+//directory clusters
+const unsigned char* borrowCluster(int fd, unsigned int clusterNum, BootSectorInfo* bsi) {
+    return borrowClusterAs(fd, clusterNum, true, bsi);
+}
+
+//file data clusters
+const unsigned char* borrowDataCluster(int fd, unsigned int clusterNum, BootSectorInfo* bsi) {
+    return borrowClusterAs(fd, clusterNum, false, bsi);
+}
+
+void releaseCluster(const unsigned char* data) {
+    if (!data || (imageMap && data >= imageMap && data < imageMap + imageMapSize)) {
+        return;
+    }
+    CacheSlot* slot = slotForData(data);
+    if (slot) {
+        slot->pins--;
+    } else {
+        free((void*)data);
+    }
+}
+
+//same as borrowDataCluster but the caller may modify the data in place.
+//releaseDirtyCluster publishes the change
+unsigned char* borrowClusterForWrite(int fd, unsigned int clusterNum, BootSectorInfo* bsi) {
+    return (unsigned char*)borrowDataCluster(fd, clusterNum, bsi);
+}
+
+bool releaseDirtyCluster(int fd, unsigned int clusterNum, unsigned char* data, BootSectorInfo* bsi) {
+    if (imageMap && data >= imageMap && data < imageMap + imageMapSize) {
+        markImageDirty(clusterOffset(clusterNum, bsi), clusterBytes(bsi));
+        return true;
+    }
+
+    CacheSlot* slot = slotForData(data);
+    if (slot) {
+        markSlotDirty(slot);
+        slot->pins--;
+        return true;
+    }
+
+    //private copy, write it through
+    bool ok = writeClusterToImage(fd, clusterNum, data, bsi);
+    free(data);
+    return ok;
+}
+
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_POOL_CLUSTERS 64
+#define DIRECT_MIN_BYTES (1024 * 1024)
+
+//O_DIRECT path for --direct. large reads stream whole clusters through an aligned
+//pool with a second fd so they don't fill the host page cache
+int directFd = -1;
+unsigned char* directPool = NULL;
+
+bool initDirectIo(const char* imagePath, BootSectorInfo* bsi) {
+    if (imageMap || overlay.fd >= 0) {
+        //data already lives in memory or is split across two files
+        return false;
+    }
+
+    directFd = open(imagePath, O_RDONLY | O_DIRECT);
+    if (directFd < 0) {
+        return false;
+    }
+    size_t clusterSize = clusterBytes(bsi);
+    if (clusterSize % 512 != 0 ||
+        posix_memalign((void**)&directPool, DIRECT_ALIGNMENT, DIRECT_POOL_CLUSTERS * clusterSize) != 0) {
+        close(directFd);
+        directFd = -1;
+        directPool = NULL;
+        return false;
+    }
+    return true;
+}
+
+void freeDirectIo() {
+    if (directFd >= 0) {
+        close(directFd);
+    }
+    free(directPool);
+    directFd = -1;
+    directPool = NULL;
+}
+
+bool clusterCached(unsigned int clusterNum) {
+    return clusterCache.capacity && hashFind(clusterNum) != NULL;
+}
+
+//read a run of physically consecutive, uncached clusters starting at first with one
+//O_DIRECT read and copy it to dest. stops at maxClusters, the pool size or the first
+//break in the chain. *next gets the cluster after the run. returns the number of
+//clusters copied, 0 means the caller should use the buffered path instead
+unsigned int readDirectRun(int fd, unsigned int first, unsigned char* dest, unsigned int maxClusters,
+                           unsigned int* next, BootSectorInfo* bsi) {
+    size_t clusterSize = clusterBytes(bsi);
+    if (maxClusters > DIRECT_POOL_CLUSTERS) maxClusters = DIRECT_POOL_CLUSTERS;
+
+    unsigned int count = 1;
+    unsigned int following = getNextCluster(fd, first, bsi);
+    while (count < maxClusters && following == first + count && !clusterCached(following)) {
+        count++;
+        following = getNextCluster(fd, following, bsi);
+    }
+
+    if (!preadFull(directFd, directPool, count * clusterSize, clusterOffset(first, bsi))) {
+        //unaligned device or filesystem without O_DIRECT, stay buffered from now on
+        printf("Warning: direct I/O failed, using buffered reads\n");
+        freeDirectIo();
+        return 0;
+    }
+    memcpy(dest, directPool, count * clusterSize);
+    *next = following;
+    return count;
+}
+
+void adviseClusters(int fd, const unsigned int* clusters, unsigned int count, BootSectorInfo* bsi);
+
+//streaming walk over every entry slot of a directory, following its cluster chain.
+//one cluster is borrowed at a time and the next one is hinted to the kernel while
+//this one is scanned. callers may change an entry in place and call
+//dirIterMarkDirty, the cluster is written back when the walk moves off it
+typedef struct DirIterator {
+    int fd;
+    BootSectorInfo* bsi;
+    unsigned int cluster;          //cluster being scanned
+    unsigned int nextCluster;      //0xFFFFFFFF after the last cluster
+    unsigned char* data;           //borrowed cluster, NULL once the walk is over
+    bool dirty;
+    unsigned int index;            //next slot within the cluster
+    unsigned int position;         //slot number within the whole directory
+    unsigned int clustersSeen;     //guards against a looping chain
+    bool (*onLoad)(struct DirIterator* it, void* arg); //sees every cluster as it is loaded
+    void* onLoadArg;
+} DirIterator;
+
+#define DIR_SCAN_LIVE 0            //next slot that isn't a tombstone, the end marker included
+#define DIR_SCAN_FREE 1            //next end marker or tombstone
+#define DIR_SCAN_MATCH 2           //next end marker or live entry whose name is the key
+
+//a name padded to the 11 bytes of an 8.3 entry, for comparing whole names at once
+typedef struct {
+    unsigned char name[16];
+} DirKey;
+
+//build the key, false when the name can't be in an entry
+bool makeDirKey(const char* name, DirKey* key) {
+    size_t length = strlen(name);
+    if (length == 0 || length > 11) {
+        return false;
+    }
+    memset(key->name, ' ', 11);
+    memcpy(key->name, name, length);
+    memset(key->name + 11, 0, 5);
+    return true;
+}
+
+//mask of the 8 entries starting at entries whose first byte is a or b
+uint32_t headMaskScalar(const unsigned char* entries, uint8_t a, uint8_t b) {
+    uint32_t mask = 0;
+    for (int i = 0; i < 8; i++) {
+        uint8_t head = entries[i * DIR_ENTRY_SIZE];
+        if (head == a || head == b) mask |= 1u << i;
+    }
+    return mask;
+}
+
+//same test as formatEntryName and strcmp: NUL padding counts as spaces
+bool keyMatchesScalar(const unsigned char* entry, const DirKey* key) {
+    for (int i = 0; i < 11; i++) {
+        unsigned char c = entry[i] ? entry[i] : ' ';
+        if (c != key->name[i]) return false;
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+//interleave the first bytes of 8 entries into the low 8 lanes, then compare them together
+uint32_t headMaskSse2(const unsigned char* entries, uint8_t a, uint8_t b) {
+    __m128i e[8];
+    for (int i = 0; i < 8; i++) {
+        e[i] = _mm_loadu_si128((const __m128i*)(entries + i * DIR_ENTRY_SIZE));
+    }
+    __m128i low = _mm_unpacklo_epi16(_mm_unpacklo_epi8(e[0], e[1]), _mm_unpacklo_epi8(e[2], e[3]));
+    __m128i high = _mm_unpacklo_epi16(_mm_unpacklo_epi8(e[4], e[5]), _mm_unpacklo_epi8(e[6], e[7]));
+    __m128i heads = _mm_unpacklo_epi32(low, high);
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(heads, _mm_set1_epi8((char)a)),
+                               _mm_cmpeq_epi8(heads, _mm_set1_epi8((char)b)));
+    return _mm_movemask_epi8(hit) & 0xFF;
+}
+
+//one gather pulls the first dword of 8 entries
+__attribute__((target("avx2"))) uint32_t headMaskAvx2(const unsigned char* entries, uint8_t a, uint8_t b) {
+    const __m256i offsets = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+    __m256i heads = _mm256_i32gather_epi32((const int*)entries, offsets, 4);
+    heads = _mm256_and_si256(heads, _mm256_set1_epi32(0xFF));
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi32(heads, _mm256_set1_epi32(a)),
+                                  _mm256_cmpeq_epi32(heads, _mm256_set1_epi32(b)));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+}
+
+//all 11 name bytes in one compare, NULs turned into spaces first
+bool keyMatchesSse2(const unsigned char* entry, const DirKey* key) {
+    __m128i name = _mm_loadu_si128((const __m128i*)entry);
+    __m128i nul = _mm_cmpeq_epi8(name, _mm_setzero_si128());
+    name = _mm_or_si128(_mm_andnot_si128(nul, name), _mm_and_si128(nul, _mm_set1_epi8(' ')));
+    __m128i same = _mm_cmpeq_epi8(name, _mm_loadu_si128((const __m128i*)key->name));
+    return (_mm_movemask_epi8(same) & 0x7FF) == 0x7FF;
+}
+
+uint32_t (*headMask)(const unsigned char*, uint8_t, uint8_t) = headMaskSse2;
+bool (*keyMatches)(const unsigned char*, const DirKey*) = keyMatchesSse2;
+const char* dirScanKind = "sse2";
+
+//pick the widest scanner the CPU runs
+void initDirScan() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        headMask = headMaskAvx2;
+        dirScanKind = "avx2";
+    }
+}
+#else
+uint32_t (*headMask)(const unsigned char*, uint8_t, uint8_t) = headMaskScalar;
+bool (*keyMatches)(const unsigned char*, const DirKey*) = keyMatchesScalar;
+const char* dirScanKind = "scalar";
+
+void initDirScan() {
+}
+#endif
+
+//whether a scan in this mode stops at the entry
+bool slotStops(const unsigned char* entry, int mode, const DirKey* key) {
+    if (mode == DIR_SCAN_LIVE) return entry[0] != 0xE5;
+    if (mode == DIR_SCAN_FREE) return entry[0] == 0x00 || entry[0] == 0xE5;
+    return entry[0] == 0x00 || (entry[11] != 0x0F && keyMatches(entry, key));
+}
+
+//first slot in [start, end) of a directory cluster that the mode stops at, end if none.
+//groups of 8 slots are tested by their first byte together, candidates are then checked
+unsigned int dirScan(const unsigned char* data, unsigned int start, unsigned int end, int mode, const DirKey* key) {
+    uint8_t a = mode == DIR_SCAN_LIVE ? 0xE5 : 0x00;
+    uint8_t b = mode == DIR_SCAN_MATCH ? key->name[0] : 0xE5;
+    unsigned int i = start;
+    for (; i + 8 <= end; i += 8) {
+        uint32_t mask = headMask(data + (size_t)i * DIR_ENTRY_SIZE, a, b);
+        if (mode == DIR_SCAN_LIVE) mask = ~mask & 0xFF;
+        while (mask) {
+            unsigned int slot = i + __builtin_ctz(mask);
+            if (slotStops(data + (size_t)slot * DIR_ENTRY_SIZE, mode, key)) return slot;
+            mask &= mask - 1;
+        }
+    }
+    for (; i < end; i++) {
+        if (slotStops(data + (size_t)i * DIR_ENTRY_SIZE, mode, key)) return i;
+    }
+    return end;
+}
+
+//borrow a directory cluster and start fetching the one after it
+bool dirIterLoad(DirIterator* it, unsigned int clusterNum) {
+    if (clusterNum < 2 || clusterNum == 0xFFFFFFFF || ++it->clustersSeen > it->bsi->totalClusters) {
+        return false;
+    }
+    it->data = (unsigned char*)borrowCluster(it->fd, clusterNum, it->bsi);
+    if (!it->data) {
+        return false;
+    }
+    it->cluster = clusterNum;
+    it->index = 0;
+    it->dirty = false;
+    it->nextCluster = getNextCluster(it->fd, clusterNum, it->bsi);
+    if (it->nextCluster >= 2 && it->nextCluster != 0xFFFFFFFF && !clusterCached(it->nextCluster)) {
+        adviseClusters(it->fd, &it->nextCluster, 1, it->bsi);
+    }
+    if (it->onLoad && !it->onLoad(it, it->onLoadArg)) {
+        releaseCluster(it->data);
+        it->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+//give back the current cluster, writing it if an entry changed
+bool dirIterRelease(DirIterator* it) {
+    if (!it->data) {
+        return true;
+    }
+    bool ok = true;
+    if (it->dirty) {
+        ok = releaseDirtyCluster(it->fd, it->cluster, it->data, it->bsi);
+    } else {
+        releaseCluster(it->data);
+    }
+    it->data = NULL;
+    return ok;
+}
+
+//open a walk that calls onLoad for each cluster, a false return ends the walk
+bool dirIterOpenWatched(DirIterator* it, int fd, unsigned int firstCluster, BootSectorInfo* bsi,
+                        bool (*onLoad)(DirIterator* it, void* arg), void* arg) {
+    memset(it, 0, sizeof(*it));
+    it->fd = fd;
+    it->bsi = bsi;
+    it->onLoad = onLoad;
+    it->onLoadArg = arg;
+    return dirIterLoad(it, firstCluster);
+}
+
+bool dirIterOpen(DirIterator* it, int fd, unsigned int firstCluster, BootSectorInfo* bsi) {
+    return dirIterOpenWatched(it, fd, firstCluster, bsi, NULL, NULL);
+}
+
+//the next entry slot, free and deleted ones included. NULL at the end of the chain
+DirEntry* dirIterNext(DirIterator* it) {
+    if (!it->data) {
+        return NULL;
+    }
+    if (it->index == entriesPerCluster(it->bsi)) {
+        unsigned int next = it->nextCluster;
+        if (!dirIterRelease(it) || !dirIterLoad(it, next)) {
+            return NULL;
+        }
+    }
+    it->position++;
+    return (DirEntry*)it->data + it->index++;
+}
+
+//like dirIterNext, but skips the slots the mode doesn't stop at in bulk
+DirEntry* dirIterScan(DirIterator* it, int mode, const DirKey* key) {
+    unsigned int perCluster = entriesPerCluster(it->bsi);
+    while (it->data) {
+        if (it->index == perCluster) {
+            unsigned int next = it->nextCluster;
+            if (!dirIterRelease(it) || !dirIterLoad(it, next)) {
+                return NULL;
+            }
+        }
+        unsigned int slot = dirScan(it->data, it->index, perCluster, mode, key);
+        it->position += slot - it->index;
+        it->index = slot;
+        if (slot < perCluster) {
+            it->position++;
+            return (DirEntry*)it->data + it->index++;
+        }
+    }
+    return NULL;
+}
+
+void dirIterMarkDirty(DirIterator* it) {
+    it->dirty = true;
+}
+
+bool dirIterClose(DirIterator* it) {
+    return dirIterRelease(it);
+}
+
+//copy an entry into a known slot of a directory cluster
+bool writeDirEntry(int fd, unsigned int clusterNum, unsigned int index, const DirEntry* entry, BootSectorInfo* bsi) {
+    unsigned char* data = (unsigned char*)borrowCluster(fd, clusterNum, bsi);
+    if (!data) {
+        return false;
+    }
+    memcpy(data + (size_t)index * DIR_ENTRY_SIZE, entry, sizeof(DirEntry));
+    return releaseDirtyCluster(fd, clusterNum, data, bsi);
+}
+
+//11-byte name with the trailing padding removed
+void formatEntryName(const DirEntry* entry, char* formattedName) {
+    strncpy(formattedName, entry->name, 11);
+    formattedName[11] = '\0';
+    for (int j = 10; j >= 0; j--) {
+        if (formattedName[j] == ' ') formattedName[j] = '\0';
+        else break;
+    }
+}
+
+//true when a directory holds nothing but '.' and '..'
+bool directoryIsEmpty(int fd, unsigned int clusterNum, BootSectorInfo* bsi) {
+    DirIterator it;
+    if (!dirIterOpen(&it, fd, clusterNum, bsi)) {
+        return false;
+    }
+    bool empty = true;
+    DirEntry* entry;
+    while ((entry = dirIterScan(&it, DIR_SCAN_LIVE, NULL)) != NULL) {
+        if (entry->name[0] == 0x00) break;
+        if (entry->attr == 0x0F) continue;
+        if (entry->name[0] == '.') continue;
+        empty = false;
+        break;
+    }
+    dirIterClose(&it);
+    return empty;
+}
+
+#define MAX_DIR_INDEXES 64
+#define DEFAULT_DIR_INDEX_BYTES (16 * 1024 * 1024)
+#define DIR_MATCH_ANY 0
+#define DIR_MATCH_DIRECTORY 1
+#define DIR_MATCH_FILE 2
+
+//where a name lives in a directory and what the entry says about it
+typedef struct {
+    char name[12];                 //trimmed 8.3 name, as formatEntryName gives it
+    uint8_t attr;
+    uint32_t firstCluster;
+    uint32_t fileSize;
+    uint32_t cluster;              //directory cluster holding the entry
+    uint32_t slot;                 //entry index within that cluster
+    uint32_t position;             //entry number in the whole directory, keeps scan order
+    int32_t next;                  //bucket chain, -1 ends it
+} DirIndexEntry;
+
+//hash of every live name in one directory, built the first time the directory is
+//searched and kept in step by the commands that change it. it also tracks the
+//free slots: a bitmap of tombstones and the position of the end marker. it is
+//dropped when the directory's first cluster leaves the cluster cache (lookups
+//keep that cluster warm), or when the index memory is needed
+typedef struct {
+    uint32_t dirCluster;           //first cluster of the directory, 0 when unused
+    uint32_t* clusters;            //the directory's chain, up to the end marker's cluster
+    unsigned int numClusters;
+    unsigned int clusterCapacity;
+    uint64_t* tombstones;          //one bit per slot before endPosition
+    unsigned int tombstoneWords;
+    unsigned int tombstoneHint;    //no set bit in the words below this one
+    unsigned int tombstoneCount;
+    uint32_t endPosition;          //the end marker's slot, or past the last cluster
+    DirIndexEntry* entries;
+    unsigned int count;
+    unsigned int capacity;
+    int32_t* buckets;
+    unsigned int numBuckets;
+    int32_t freeList;              //removed entries, reused by inserts
+    unsigned long long lastUsed;
+} DirIndex;
+
+typedef struct {
+    DirIndex indexes[MAX_DIR_INDEXES];
+    unsigned long long clock;
+    unsigned long long bytes;
+    unsigned long long limit;
+    unsigned long long hits;       //lookups answered by an index
+    unsigned long long builds;
+    DirIndex* building;            //index being filled, eviction only marks it stale
+    bool buildStale;
+} DirIndexTable;
+
+DirIndexTable dirIndexTable = { .limit = DEFAULT_DIR_INDEX_BYTES };
+
+uint32_t hashName(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+unsigned long long dirIndexBytes(DirIndex* index) {
+    return (unsigned long long)index->capacity * sizeof(DirIndexEntry) + index->numBuckets * sizeof(int32_t) +
+           index->clusterCapacity * sizeof(uint32_t) + index->tombstoneWords * sizeof(uint64_t);
+}
+
+void dropDirIndex(DirIndex* index) {
+    if (!index->dirCluster) {
+        return;
+    }
+    dirIndexTable.bytes -= dirIndexBytes(index);
+    free(index->clusters);
+    free(index->tombstones);
+    free(index->entries);
+    free(index->buckets);
+    memset(index, 0, sizeof(*index));
+}
+
+void dropAllDirIndexes() {
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        dropDirIndex(&dirIndexTable.indexes[i]);
+    }
+}
+
+//a directory's first cluster left the cluster cache
+void dirIndexEvicted(unsigned int clusterNum) {
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        DirIndex* index = &dirIndexTable.indexes[i];
+        if (index->dirCluster != clusterNum) continue;
+        if (index == dirIndexTable.building) {
+            dirIndexTable.buildStale = true;
+        } else {
+            dropDirIndex(index);
+        }
+    }
+}
+
+//drop least recently used indexes until the table fits under limit. keep is the
+//index in use, it stays even when it alone is over the limit
+void trimDirIndexes(unsigned long long limit, DirIndex* keep) {
+    while (dirIndexTable.bytes > limit) {
+        DirIndex* oldest = NULL;
+        for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+            DirIndex* index = &dirIndexTable.indexes[i];
+            if (index->dirCluster && index != keep && (!oldest || index->lastUsed < oldest->lastUsed)) {
+                oldest = index;
+            }
+        }
+        if (!oldest) break;
+        dropDirIndex(oldest);
+    }
+}
+
+void dirIndexLink(DirIndex* index, int32_t i) {
+    uint32_t bucket = hashName(index->entries[i].name) & (index->numBuckets - 1);
+    index->entries[i].next = index->buckets[bucket];
+    index->buckets[bucket] = i;
+}
+
+//add a live entry, growing the tables when they fill up
+bool dirIndexInsert(DirIndex* index, const DirEntry* entry, uint32_t clusterNum, uint32_t slot, uint32_t position) {
+    int32_t i = index->freeList;
+    if (i >= 0) {
+        index->freeList = index->entries[i].next;
+    } else {
+        if (index->count == index->capacity) {
+            unsigned long long before = dirIndexBytes(index);
+            unsigned int capacity = index->capacity ? index->capacity * 2 : 64;
+            DirIndexEntry* entries = realloc(index->entries, capacity * sizeof(DirIndexEntry));
+            int32_t* buckets = malloc(capacity * sizeof(int32_t));
+            if (!entries || !buckets) {
+                if (entries) index->entries = entries;
+                free(buckets);
+                return false;
+            }
+            free(index->buckets);
+            index->entries = entries;
+            index->buckets = buckets;
+            index->capacity = capacity;
+            index->numBuckets = capacity;
+            memset(index->buckets, 0xFF, capacity * sizeof(int32_t));
+            for (unsigned int e = 0; e < index->count; e++) {
+                if (index->entries[e].name[0]) dirIndexLink(index, e);
+            }
+            dirIndexTable.bytes += dirIndexBytes(index) - before;
+        }
+        i = index->count++;
+    }
+
+    DirIndexEntry* indexed = &index->entries[i];
+    formatEntryName(entry, indexed->name);
+    if (!indexed->name[0]) {
+        //an all-space name can't be looked up, keep a placeholder so the slot isn't lost
+        strcpy(indexed->name, " ");
+    }
+    indexed->attr = entry->attr;
+    indexed->firstCluster = dirEntryCluster(entry);
+    indexed->fileSize = entry->fileSize;
+    indexed->cluster = clusterNum;
+    indexed->slot = slot;
+    indexed->position = position;
+    dirIndexLink(index, i);
+    return true;
+}
+
+//first entry in directory order with this name that passes the filter
+int32_t dirIndexFind(DirIndex* index, const char* name, int match) {
+    int32_t best = -1;
+    uint32_t bucket = hashName(name) & (index->numBuckets - 1);
+    for (int32_t i = index->buckets[bucket]; i >= 0; i = index->entries[i].next) {
+        DirIndexEntry* entry = &index->entries[i];
+        bool isDirectory = entry->attr & ATTR_DIRECTORY;
+        if (strcmp(entry->name, name) != 0 || (match == DIR_MATCH_DIRECTORY && !isDirectory) ||
+            (match == DIR_MATCH_FILE && isDirectory)) {
+            continue;
+        }
+        if (best < 0 || entry->position < index->entries[best].position) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void dirIndexRemove(DirIndex* index, int32_t i) {
+    uint32_t bucket = hashName(index->entries[i].name) & (index->numBuckets - 1);
+    int32_t* link = &index->buckets[bucket];
+    while (*link >= 0 && *link != i) {
+        link = &index->entries[*link].next;
+    }
+    if (*link == i) *link = index->entries[i].next;
+
+    //the slot is a tombstone now
+    uint32_t position = index->entries[i].position;
+    if (position < index->endPosition) {
+        index->tombstones[position / 64] |= 1ULL << (position % 64);
+        index->tombstoneCount++;
+        if (position / 64 < index->tombstoneHint) index->tombstoneHint = position / 64;
+    }
+    index->entries[i].name[0] = '\0';
+    index->entries[i].next = index->freeList;
+    index->freeList = i;
+}
+
+#define MAX_DIR_FILTERS 256
+#define DIR_FILTER_BITS_PER_NAME 10
+#define DIR_FILTER_HASHES 7
+
+//bloom filter of the names in one directory. it is far smaller than the name
+//index and isn't tied to the cluster cache, so a name that was never created
+//is turned away without reading the directory even after its index is gone.
+//deletes leave their bits set, they only cost false positives
+typedef struct {
+    uint32_t dirCluster;           //first cluster of the directory, 0 when unused
+    uint64_t* bits;
+    uint32_t numBits;              //power of two
+    uint32_t capacity;             //names it was sized for, past that it is rebuilt
+    uint32_t names;
+    unsigned long long queries;
+    unsigned long long negatives;  //lookups answered without the directory
+    unsigned long long falsePositives;
+    unsigned long long lastUsed;
+} DirFilter;
+
+typedef struct {
+    DirFilter filters[MAX_DIR_FILTERS];
+    unsigned long long clock;
+    unsigned long long bytes;
+} DirFilterTable;
+
+DirFilterTable dirFilterTable;
+
+//second hash for double hashing, odd so every probe lands on a new bit
+uint32_t filterStep(uint32_t hash) {
+    return (((hash >> 16) | (hash << 16)) * 0x9E3779B1u) | 1;
+}
+
+void dirFilterSet(DirFilter* filter, uint32_t hash) {
+    uint32_t step = filterStep(hash);
+    for (int k = 0; k < DIR_FILTER_HASHES; k++, hash += step) {
+        uint32_t bit = hash & (filter->numBits - 1);
+        filter->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+bool dirFilterMayContain(DirFilter* filter, uint32_t hash) {
+    uint32_t step = filterStep(hash);
+    for (int k = 0; k < DIR_FILTER_HASHES; k++, hash += step) {
+        uint32_t bit = hash & (filter->numBits - 1);
+        if (!(filter->bits[bit / 64] & (1ULL << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+void dropDirFilter(DirFilter* filter) {
+    if (!filter->dirCluster) {
+        return;
+    }
+    dirFilterTable.bytes -= filter->numBits / 8;
+    free(filter->bits);
+    memset(filter, 0, sizeof(*filter));
+}
+
+void dropAllDirFilters() {
+    for (int i = 0; i < MAX_DIR_FILTERS; i++) {
+        dropDirFilter(&dirFilterTable.filters[i]);
+    }
+}
+
+DirFilter* findDirFilter(uint32_t dirCluster) {
+    for (int i = 0; i < MAX_DIR_FILTERS; i++) {
+        if (dirFilterTable.filters[i].dirCluster == dirCluster) {
+            dirFilterTable.filters[i].lastUsed = ++dirFilterTable.clock;
+            return &dirFilterTable.filters[i];
+        }
+    }
+    return NULL;
+}
+
+//replace the directory's filter with one holding these name hashes, of at least
+//minBits. a rebuild of the same directory keeps its lookup counts
+void buildDirFilter(uint32_t dirCluster, const uint32_t* hashes, unsigned int count, uint32_t minBits) {
+    DirFilter* filter = findDirFilter(dirCluster);
+    DirFilter previous = { 0 };
+    if (filter) {
+        previous = *filter;
+    } else {
+        for (int i = 0; i < MAX_DIR_FILTERS; i++) {
+            DirFilter* candidate = &dirFilterTable.filters[i];
+            if (!candidate->dirCluster) {
+                filter = candidate;
+                break;
+            }
+            if (!filter || candidate->lastUsed < filter->lastUsed) {
+                filter = candidate;
+            }
+        }
+    }
+    dropDirFilter(filter);
+
+    //room for twice the names it starts with, so creates don't force a rebuild soon
+    uint32_t numBits = 512;
+    while ((numBits < minBits || numBits < (uint64_t)count * 2 * DIR_FILTER_BITS_PER_NAME) && numBits < (1u << 31)) {
+        numBits *= 2;
+    }
+    filter->bits = calloc(numBits / 64, sizeof(uint64_t));
+    if (!filter->bits) {
+        return;
+    }
+    filter->dirCluster = dirCluster;
+    filter->numBits = numBits;
+    filter->capacity = numBits / DIR_FILTER_BITS_PER_NAME;
+    filter->lastUsed = ++dirFilterTable.clock;
+    filter->queries = previous.queries;
+    filter->negatives = previous.negatives;
+    filter->falsePositives = previous.falsePositives;
+    dirFilterTable.bytes += numBits / 8;
+    for (unsigned int i = 0; i < count; i++) {
+        dirFilterSet(filter, hashes[i]);
+    }
+    filter->names = count;
+}
+
+DirIndex* findDirIndex(uint32_t dirCluster);
+
+//a name was added to a directory. a full filter is too crowded to stay accurate,
+//it is rebuilt at twice the size from the names in the directory's index. without
+//an index it goes, and the next full scan sizes a new one
+void dirFilterAdded(uint32_t dirCluster, const char* name) {
+    DirFilter* filter = findDirFilter(dirCluster);
+    if (!filter) {
+        return;
+    }
+    if (filter->names >= filter->capacity) {
+        DirIndex* index = findDirIndex(dirCluster);
+        uint32_t* hashes = index ? malloc((index->count + 1) * sizeof(uint32_t)) : NULL;
+        if (!hashes) {
+            dropDirFilter(filter);
+            return;
+        }
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < index->count; i++) {
+            if (index->entries[i].name[0]) hashes[count++] = hashName(index->entries[i].name);
+        }
+        hashes[count++] = hashName(name);
+        buildDirFilter(dirCluster, hashes, count, filter->numBits * 2);
+        free(hashes);
+        return;
+    }
+    dirFilterSet(filter, hashName(name));
+    filter->names++;
+}
+
+//handle the dirstats command
+void printDirFilterStats() {
+    unsigned int count = 0;
+    for (int i = 0; i < MAX_DIR_FILTERS; i++) {
+        DirFilter* filter = &dirFilterTable.filters[i];
+        if (!filter->dirCluster) continue;
+        unsigned long long absent = filter->negatives + filter->falsePositives;
+        printf("Directory cluster %u: %u names, %u bytes, %llu lookups, %llu filtered, false positive rate %.1f%%\n",
+               filter->dirCluster, filter->names, filter->numBits / 8, filter->queries, filter->negatives,
+               absent ? 100.0 * filter->falsePositives / absent : 0.0);
+        count++;
+    }
+    printf("Name filters: %u directories, %llu bytes\n", count, dirFilterTable.bytes);
+    printf("Entry scanner: %s\n", dirScanKind);
+}
+
+//the index of a directory if one is already built
+DirIndex* findDirIndex(uint32_t dirCluster) {
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        if (dirIndexTable.indexes[i].dirCluster == dirCluster) {
+            dirIndexTable.indexes[i].lastUsed = ++dirIndexTable.clock;
+            return &dirIndexTable.indexes[i];
+        }
+    }
+    return NULL;
+}
+
+//add a cluster to the end of the index's chain. data is the cluster for one the
+//walk loaded, its tombstones are noted 8 slots at a time. NULL for a fresh one
+bool dirIndexAppendCluster(DirIndex* index, uint32_t clusterNum, const unsigned char* data, BootSectorInfo* bsi) {
+    unsigned int perCluster = entriesPerCluster(bsi);
+    unsigned long long before = dirIndexBytes(index);
+    if (index->numClusters == index->clusterCapacity) {
+        unsigned int capacity = index->clusterCapacity ? index->clusterCapacity * 2 : 8;
+        uint32_t* clusters = realloc(index->clusters, capacity * sizeof(uint32_t));
+        if (!clusters) {
+            return false;
+        }
+        index->clusters = clusters;
+        index->clusterCapacity = capacity;
+    }
+    unsigned int words = ((index->numClusters + 1) * perCluster + 63) / 64;
+    if (words > index->tombstoneWords) {
+        unsigned int grown = words > index->tombstoneWords * 2 ? words : index->tombstoneWords * 2;
+        uint64_t* tombstones = realloc(index->tombstones, grown * sizeof(uint64_t));
+        if (!tombstones) {
+            return false;
+        }
+        memset(tombstones + index->tombstoneWords, 0, (grown - index->tombstoneWords) * sizeof(uint64_t));
+        index->tombstones = tombstones;
+        index->tombstoneWords = grown;
+    }
+
+    uint32_t base = index->numClusters * perCluster;
+    for (unsigned int i = 0; data && i < perCluster; i += 8) {
+        uint32_t mask = headMask(data + (size_t)i * DIR_ENTRY_SIZE, 0xE5, 0xE5);
+        while (mask) {
+            uint32_t position = base + i + __builtin_ctz(mask);
+            index->tombstones[position / 64] |= 1ULL << (position % 64);
+            index->tombstoneCount++;
+            mask &= mask - 1;
+        }
+    }
+    index->clusters[index->numClusters++] = clusterNum;
+    dirIndexTable.bytes += dirIndexBytes(index) - before;
+    return true;
+}
+
+bool dirIndexClusterLoaded(DirIterator* it, void* arg) {
+    return dirIndexAppendCluster((DirIndex*)arg, it->cluster, it->data, it->bsi);
+}
+
+//the directory's index, built with one walk of its chain the first time
+DirIndex* getDirIndex(int fd, uint32_t dirCluster, BootSectorInfo* bsi) {
+    DirIndex* index = findDirIndex(dirCluster);
+    if (index) {
+        //keep the first cluster warm, the index lives as long as it is cached
+        CacheSlot* head = clusterCache.capacity ? hashFind(dirCluster) : NULL;
+        if (head) promoteSlot(head);
+        dirIndexTable.hits++;
+        return index;
+    }
+
+    //reuse an empty entry or the least recently used one
+    DirIndex* victim = NULL;
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        DirIndex* candidate = &dirIndexTable.indexes[i];
+        if (!candidate->dirCluster) {
+            victim = candidate;
+            break;
+        }
+        if (!victim || candidate->lastUsed < victim->lastUsed) {
+            victim = candidate;
+        }
+    }
+    dropDirIndex(victim);
+    index = victim;
+
+    //start with small tables so an empty directory still answers "not found"
+    index->capacity = index->numBuckets = 16;
+    index->entries = malloc(index->capacity * sizeof(DirIndexEntry));
+    index->buckets = malloc(index->numBuckets * sizeof(int32_t));
+    index->dirCluster = dirCluster;
+    index->freeList = -1;
+    index->lastUsed = ++dirIndexTable.clock;
+    dirIndexTable.bytes += dirIndexBytes(index);
+    if (!index->entries || !index->buckets) {
+        dropDirIndex(index);
+        return NULL;
+    }
+    memset(index->buckets, 0xFF, index->numBuckets * sizeof(int32_t));
+
+    //pin the first cluster so it can't be evicted before its slot is marked
+    const unsigned char* head = clusterCache.capacity ? borrowCluster(fd, dirCluster, bsi) : NULL;
+    dirIndexTable.building = index;
+    dirIndexTable.buildStale = false;
+
+    DirIterator it;
+    bool ok = dirIterOpenWatched(&it, fd, dirCluster, bsi, dirIndexClusterLoaded, index);
+    bool ended = false;
+    const DirEntry* entry;
+    while (ok && (entry = dirIterScan(&it, DIR_SCAN_LIVE, NULL)) != NULL) {
+        if (entry->name[0] == 0x00) {
+            index->endPosition = it.position - 1;
+            ended = true;
+            break;
+        }
+        if (entry->attr == 0x0F) continue;
+        ok = dirIndexInsert(index, entry, it.cluster, it.index - 1, it.position - 1);
+    }
+    if (ok && !ended) {
+        //no end marker, the walk must have reached the end of the chain
+        ok = it.nextCluster == 0xFFFFFFFF && index->numClusters == it.clustersSeen;
+        index->endPosition = index->numClusters * entriesPerCluster(bsi);
+    }
+    dirIterClose(&it);
+    dirIndexTable.building = NULL;
+
+    if (head) {
+        CacheSlot* slot = hashFind(dirCluster);
+        if (slot) slot->indexed = true;
+        releaseCluster(head);
+    }
+    if (!ok || dirIndexTable.buildStale) {
+        dropDirIndex(index);
+        return NULL;
+    }
+
+    //slots after the end marker are free whatever they hold
+    uint32_t limit = index->numClusters * entriesPerCluster(bsi);
+    for (uint32_t position = index->endPosition; position < limit; position++) {
+        uint64_t bit = 1ULL << (position % 64);
+        if (index->tombstones[position / 64] & bit) {
+            index->tombstones[position / 64] &= ~bit;
+            index->tombstoneCount--;
+        }
+    }
+    dirIndexTable.builds++;
+
+    //the walk saw every name, give the directory a fresh filter too
+    uint32_t* hashes = malloc((index->count + 1) * sizeof(uint32_t));
+    if (hashes) {
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < index->count; i++) {
+            if (index->entries[i].name[0]) hashes[count++] = hashName(index->entries[i].name);
+        }
+        buildDirFilter(dirCluster, hashes, count, 0);
+        free(hashes);
+    }
+    trimDirIndexes(dirIndexTable.limit, index);
+    return index;
+}
+
+//look a name up in a directory, through its index when one can be built and with
+//a plain walk of the chain otherwise. match limits the hit to files or directories
+bool findDirEntry(int fd, uint32_t dirCluster, const char* name, int match, DirIndexEntry* found, BootSectorInfo* bsi) {
+    DirKey key;
+    if (!makeDirKey(name, &key)) {
+        return false;
+    }
+
+    //a definite miss in the filter needs no directory cluster at all
+    DirFilter* filter = findDirFilter(dirCluster);
+    if (filter) {
+        filter->queries++;
+        if (!dirFilterMayContain(filter, hashName(name))) {
+            filter->negatives++;
+            return false;
+        }
+    }
+
+    DirIndex* index = getDirIndex(fd, dirCluster, bsi);
+    if (index) {
+        int32_t i = dirIndexFind(index, name, match);
+        if (i < 0) {
+            if (filter && findDirFilter(dirCluster) == filter && dirIndexFind(index, name, DIR_MATCH_ANY) < 0) {
+                filter->falsePositives++;
+            }
+            return false;
+        }
+        *found = index->entries[i];
+        return true;
+    }
+
+    DirIterator it;
+    if (!dirIterOpen(&it, fd, dirCluster, bsi)) {
+        return false;
+    }
+
+    //without a filter, collect the name hashes on the way so a walk that reaches the
+    //end can build one. with a filter, only the slots holding the key are looked at
+    int mode = filter ? DIR_SCAN_MATCH : DIR_SCAN_LIVE;
+    unsigned int numHashes = 0;
+    unsigned int hashCapacity = 64;
+    uint32_t* hashes = filter ? NULL : malloc(hashCapacity * sizeof(uint32_t));
+    bool hit = false;
+    bool nameSeen = false;
+    bool complete = false;
+    const DirEntry* entry;
+    while ((entry = dirIterScan(&it, mode, &key)) != NULL) {
+        if (entry->name[0] == 0x00) {
+            complete = true;
+            break;
+        }
+        if (entry->attr == 0x0F) continue;
+
+        char formattedName[12];
+        formatEntryName(entry, formattedName);
+        if (hashes && numHashes == hashCapacity) {
+            hashCapacity *= 2;
+            uint32_t* grown = realloc(hashes, hashCapacity * sizeof(uint32_t));
+            if (!grown) free(hashes);
+            hashes = grown;
+        }
+        if (hashes) hashes[numHashes++] = hashName(formattedName);
+
+        bool isDirectory = entry->attr & ATTR_DIRECTORY;
+        if (strcmp(formattedName, name) != 0) {
+            continue;
+        }
+        nameSeen = true;
+        if ((match == DIR_MATCH_DIRECTORY && !isDirectory) || (match == DIR_MATCH_FILE && isDirectory)) {
+            continue;
+        }
+        strcpy(found->name, formattedName);
+        found->attr = entry->attr;
+        found->firstCluster = dirEntryCluster(entry);
+        found->fileSize = entry->fileSize;
+        found->cluster = it.cluster;
+        found->slot = it.index - 1;
+        found->position = it.position - 1;
+        hit = true;
+        break;
+    }
+    if (!entry && it.nextCluster == 0xFFFFFFFF) {
+        complete = true;
+    }
+    dirIterClose(&it);
+
+    if (!hit && !nameSeen && filter) {
+        filter->falsePositives++;
+    }
+    if (complete && hashes) {
+        buildDirFilter(dirCluster, hashes, numHashes, 0);
+    }
+    free(hashes);
+    return hit;
+}
+
+//where a new entry goes
+typedef struct {
+    uint32_t cluster;
+    uint32_t slot;
+    uint32_t position;             //slot number within the whole directory
+} DirSlot;
+
+void forgetDirIndex(uint32_t dirCluster) {
+    DirIndex* index = findDirIndex(dirCluster);
+    if (index) dropDirIndex(index);
+}
+
+//link a zeroed cluster onto the end of a directory's chain, 0 when that fails
+uint32_t growDirectory(int fd, uint32_t lastCluster, BootSectorInfo* bsi) {
+    uint32_t cluster = allocateCluster(fd, bsi);
+    if (!cluster) {
+        return 0;
+    }
+    unsigned char* data = (unsigned char*)borrowCluster(fd, cluster, bsi);
+    if (!data) {
+        freeCluster(fd, cluster, bsi);
+        return 0;
+    }
+    memset(data, 0, clusterBytes(bsi));
+    if (!releaseDirtyCluster(fd, cluster, data, bsi) || !setFatEntry(fd, lastCluster, cluster, bsi)) {
+        freeCluster(fd, cluster, bsi);
+        return 0;
+    }
+    return cluster;
+}
+
+//the lowest tombstone, else the end marker, else the first slot of a new cluster
+bool dirIndexTakeSlot(int fd, DirIndex* index, DirSlot* where, BootSectorInfo* bsi) {
+    unsigned int perCluster = entriesPerCluster(bsi);
+    unsigned int usedWords = (index->endPosition + 63) / 64;
+    uint32_t position = index->endPosition;
+    for (unsigned int w = index->tombstoneHint; w < usedWords; w++) {
+        if (index->tombstones[w]) {
+            position = w * 64 + __builtin_ctzll(index->tombstones[w]);
+            index->tombstones[w] &= index->tombstones[w] - 1;
+            index->tombstoneCount--;
+            index->tombstoneHint = w;
+            break;
+        }
+    }
+
+    if (position == index->endPosition) {
+        index->tombstoneHint = usedWords;
+
+        //the chain may go on past the end marker's cluster, grow it only at its real end
+        if (position == index->numClusters * perCluster) {
+            uint32_t last = index->clusters[index->numClusters - 1];
+            uint32_t next = getNextCluster(fd, last, bsi);
+            bool headEvicted = false;
+            if (next < 2 || next == 0xFFFFFFFF) {
+                //loading the new cluster can evict the head, which would drop the
+                //index under us. only mark it stale while growing
+                dirIndexTable.building = index;
+                dirIndexTable.buildStale = false;
+                next = growDirectory(fd, last, bsi);
+                dirIndexTable.building = NULL;
+                headEvicted = dirIndexTable.buildStale;
+            }
+            if (next && headEvicted) {
+                //the head is gone, so is the index. the new cluster's first slot is ours
+                dropDirIndex(index);
+                where->cluster = next;
+                where->slot = 0;
+                where->position = position;
+                return true;
+            }
+            if (!next || !dirIndexAppendCluster(index, next, NULL, bsi)) {
+                return false;
+            }
+        }
+        index->endPosition++;
+    }
+
+    where->cluster = index->clusters[position / perCluster];
+    where->slot = position % perCluster;
+    where->position = position;
+    return true;
+}
+
+//a slot for a new entry in a directory, which grows by a cluster when it is full
+bool findFreeSlot(int fd, uint32_t dirCluster, DirSlot* where, BootSectorInfo* bsi) {
+    DirIndex* index = getDirIndex(fd, dirCluster, bsi);
+    if (index) {
+        if (dirIndexTakeSlot(fd, index, where, bsi)) {
+            return true;
+        }
+        dropDirIndex(index);
+        return false;
+    }
+
+    //no index, search the whole chain
+    DirIterator it;
+    if (!dirIterOpen(&it, fd, dirCluster, bsi)) {
+        return false;
+    }
+    bool found = dirIterScan(&it, DIR_SCAN_FREE, NULL) != NULL;
+    if (found) {
+        where->cluster = it.cluster;
+        where->slot = it.index - 1;
+        where->position = it.position - 1;
+    }
+    bool chainEnded = !found && it.nextCluster == 0xFFFFFFFF;
+    uint32_t last = it.cluster;
+    uint32_t position = it.clustersSeen * entriesPerCluster(bsi);
+    dirIterClose(&it);
+    if (found || !chainEnded) {
+        return found;
+    }
+
+    uint32_t cluster = growDirectory(fd, last, bsi);
+    if (!cluster) {
+        return false;
+    }
+    where->cluster = cluster;
+    where->slot = 0;
+    where->position = position;
+    return true;
+}
+
+//a new entry was written into a directory, keep its index in step
+void dirIndexAdded(uint32_t dirCluster, const DirEntry* entry, const DirSlot* where) {
+    char name[12];
+    formatEntryName(entry, name);
+    dirFilterAdded(dirCluster, name);
+
+    DirIndex* index = findDirIndex(dirCluster);
+    if (index && !dirIndexInsert(index, entry, where->cluster, where->slot, where->position)) {
+        dropDirIndex(index);
+    }
+    trimDirIndexes(dirIndexTable.limit, index);
+}
+
+//an entry was deleted from a directory
+void dirIndexRemoved(uint32_t dirCluster, const char* name, uint32_t position) {
+    DirIndex* index = findDirIndex(dirCluster);
+    if (!index) {
         return;
     }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
+    uint32_t bucket = hashName(name) & (index->numBuckets - 1);
+    for (int32_t i = index->buckets[bucket]; i >= 0; i = index->entries[i].next) {
+        if (index->entries[i].position == position) {
+            dirIndexRemove(index, i);
+            return;
+        }
+    }
+}
+
+//mark an entry deleted in place
+bool deleteDirEntry(int fd, uint32_t clusterNum, uint32_t slot, BootSectorInfo* bsi) {
+    unsigned char* data = (unsigned char*)borrowCluster(fd, clusterNum, bsi);
+    if (!data) {
+        return false;
+    }
+    data[(size_t)slot * DIR_ENTRY_SIZE] = 0xE5;
+    return releaseDirtyCluster(fd, clusterNum, data, bsi);
+}
+
+void printDirIndexStats() {
+    unsigned int built = 0;
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        if (dirIndexTable.indexes[i].dirCluster) built++;
+    }
+    printf("Dir index: %u directories, %llu of %llu bytes, %llu hits, %llu builds\n", built, dirIndexTable.bytes,
+           dirIndexTable.limit, dirIndexTable.hits, dirIndexTable.builds);
+}
+
+#define DENTRY_CACHE_SIZE 4096         //power of two
+
+//resolved path component: the directory called name inside parent starts at cluster.
+//the table is direct mapped, a new entry simply replaces whatever hashed to its slot
+typedef struct {
+    uint32_t parent;               //0 marks an empty slot
+    uint32_t cluster;
+    char name[12];
+} Dentry;
+
+typedef struct {
+    Dentry entries[DENTRY_CACHE_SIZE];
+    unsigned long long hits;
+    unsigned long long misses;
+} DentryCache;
+
+DentryCache dentryCache;
+
+Dentry* dentrySlot(uint32_t parent, const char* name) {
+    return &dentryCache.entries[(hashName(name) ^ (parent * 0x9E3779B1u)) & (DENTRY_CACHE_SIZE - 1)];
+}
+
+//the cluster of a subdirectory, from the cache or through a lookup that fills it
+bool resolveComponent(int fd, uint32_t parent, const char* name, uint32_t* cluster, BootSectorInfo* bsi) {
+    Dentry* dentry = dentrySlot(parent, name);
+    if (dentry->parent == parent && strcmp(dentry->name, name) == 0) {
+        dentryCache.hits++;
+        *cluster = dentry->cluster;
+        return true;
+    }
+    dentryCache.misses++;
+
+    DirIndexEntry found;
+    if (!findDirEntry(fd, parent, name, DIR_MATCH_DIRECTORY, &found, bsi)) {
+        return false;
+    }
+    *cluster = found.firstCluster ? found.firstCluster : bsi->rootCluster;
+    dentry->parent = parent;
+    dentry->cluster = *cluster;
+    strcpy(dentry->name, found.name);
+    return true;
+}
+
+//a name left a directory
+void dentryRemoved(uint32_t parent, const char* name) {
+    Dentry* dentry = dentrySlot(parent, name);
+    if (dentry->parent == parent && strcmp(dentry->name, name) == 0) {
+        dentry->parent = 0;
+    }
+}
+
+void clearDentryCache() {
+    memset(dentryCache.entries, 0, sizeof(dentryCache.entries));
+}
+
+void printDentryStats() {
+    printf("Path cache: %llu hits, %llu misses\n", dentryCache.hits, dentryCache.misses);
+}
+
+#define DEFAULT_DIR_PREFETCH 16
+
+//first clusters of the subdirectories seen by the last directory scan. they are
+//loaded after the command, in the background when the flusher thread runs, so
+//the next cd finds them cached. limit caps the fan-out of one scan
+typedef struct {
+    unsigned int* clusters;
+    unsigned int count;
+    unsigned int limit;
+} DirPrefetch;
+
+DirPrefetch dirPrefetch = { NULL, 0, DEFAULT_DIR_PREFETCH };
+
+bool initDirPrefetch() {
+    if (dirPrefetch.limit == 0) {
+        return true;
+    }
+    dirPrefetch.clusters = malloc(dirPrefetch.limit * sizeof(unsigned int));
+    if (!dirPrefetch.clusters) {
+        dirPrefetch.limit = 0;
+        return false;
+    }
+    return true;
+}
+
+void freeDirPrefetch() {
+    free(dirPrefetch.clusters);
+    dirPrefetch.clusters = NULL;
+    dirPrefetch.count = 0;
+}
+
+//queue a subdirectory's first cluster unless it is already cached
+void noteSubdirectoryCluster(unsigned int cluster, BootSectorInfo* bsi) {
+    if (dirPrefetch.count < dirPrefetch.limit && cluster >= 2 && cluster != bsi->rootCluster &&
+        !clusterCached(cluster)) {
+        dirPrefetch.clusters[dirPrefetch.count++] = cluster;
+    }
+}
+
+//queue the entry's first cluster if it is a real subdirectory
+void noteSubdirectory(const DirEntry* entry, BootSectorInfo* bsi) {
+    if (entry->attr == 0x0F || !(entry->attr & ATTR_DIRECTORY) || entry->name[0] == '.') {
         return;
     }
+    noteSubdirectoryCluster(dirEntryCluster(entry), bsi);
+}
+
+//fucntion to handle the cd command
+void changeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
+    if (strcmp(dirName, ".") == 0) {
+        printf("Staying in the current directory.\n");
+        return; 
+    }
+    if (strcmp(dirName, "..") == 0 && context->depth == 0) {
+        printf("Already in the root directory.\n");
+        return; 
+    }
 
-    DirEntry* entries = (DirEntry*)buffer;
-    int numEntries = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool found = false;
-    bool isEmpty = true;
+    //walk a copy so a bad component leaves the current directory alone
+    DirectoryContext next = *context;
+    if (dirName[0] == '/') {
+        next.currentCluster = bsi->rootCluster;
+        next.depth = 0;
+        strcpy(next.path, "/");
+    }
 
-    //search for directory with formatted name, ignore deleted directories
-    for (int i = 0; i < numEntries; i++) {
-        if (entries[i].name[0] == 0x00) {
-            break; 
+    char components[256];
+    strncpy(components, dirName, sizeof(components) - 1);
+    components[sizeof(components) - 1] = '\0';
+    uint32_t lastParent = 0;
+    char* save = NULL;
+    for (char* name = strtok_r(components, "/", &save); name; name = strtok_r(NULL, "/", &save)) {
+        if (strcmp(name, ".") == 0) {
+            continue;
         }
-        if ((unsigned char)entries[i].name[0] == 0xE5) {
-            continue; 
+
+        //the parent is on the stack, '..' in the root stays there
+        if (strcmp(name, "..") == 0) {
+            if (next.depth > 0) {
+                next.currentCluster = next.parents[--next.depth];
+                char* lastSlash = strrchr(next.path, '/');
+                if (lastSlash == next.path) {
+                    next.path[1] = '\0';
+                } else if (lastSlash) {
+                    *lastSlash = '\0';
+                }
+            }
+            continue;
         }
-        char formattedName[12];
-        strncpy(formattedName, entries[i].name, 11);
-        formattedName[11] = '\0';
 
-        //remove trailing spaces from filename
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
+        uint32_t cluster;
+        if (!resolveComponent(fd, next.currentCluster, name, &cluster, bsi)) {
+            printf("Directory not found: %s\n", name);
+            return;
+        }
+        if (next.depth == MAX_DIR_DEPTH) {
+            printf("Error: Path too deep\n");
+            return;
         }
 
-        if (strcmp(formattedName, dirName) == 0 && (entries[i].attr & ATTR_DIRECTORY)) {
-            found = true;
+        //update the path and the current cluster
+        size_t length = strlen(next.path);
+        if (snprintf(next.path + length, sizeof(next.path) - length, "%s%s", length > 1 ? "/" : "", name) >=
+            (int)(sizeof(next.path) - length)) {
+            printf("Error: New path too long\n");
+            return;
+        }
+        lastParent = next.currentCluster;
+        next.parents[next.depth++] = next.currentCluster;
+        next.currentCluster = cluster;
+    }
 
-            //check if the directory is empty by attempting to read its cluster
-            unsigned int dirCluster = (entries[i].firstClusterHigh << 16) | entries[i].firstClusterLow;
-            unsigned char* dirBuffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-            if (!dirBuffer || !readCluster(fd, dirCluster, dirBuffer, bsi)) {
-                isEmpty = false; 
-            } else {
-                DirEntry* dirEntries = (DirEntry*)dirBuffer;
-                for (int j = 0; j < numEntries; j++) {
-                    if (dirEntries[j].name[0] == 0x00) {
-                        break; 
-                    }
-                    if ((unsigned char)dirEntries[j].name[0] == 0xE5) {
-                        continue; 
-                    }
-                    if (j > 1) { 
-                        isEmpty = false;
-                        break;
-                    }
-                }
-            }
-            free(dirBuffer);
-            //mark the directory as deleted
-            if (isEmpty) {
-                entries[i].name[0] = 0xE5; 
+    //the other subdirectories next to the last one are likely next, queue them for prefetch
+    DirIndex* index = lastParent ? findDirIndex(lastParent) : NULL;
+    dirPrefetch.count = 0;
+    for (unsigned int i = 0; index && i < index->count; i++) {
+        DirIndexEntry* entry = &index->entries[i];
+        if (entry->name[0] && entry->name[0] != '.' && (entry->attr & ATTR_DIRECTORY)) {
+            noteSubdirectoryCluster(entry->firstCluster, bsi);
+        }
+    }
+
+    *context = next;
+    if (strcmp(dirName, "..") == 0) {
+        printf("Changed directory to parent: %s\n", context->path);
+    } else {
+        printf("Changed directory to %s\n", dirName);
+    }
+}
+
+//info function
+void printBootSectorInfo(const char *imagePath) {
+    //open the image with correct permissions
+    int fd = open(imagePath, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open image file");
+        return;
+    }
+
+    //read the boot sector and print an error message if failed
+    unsigned char bootSector[512];
+    if (!readAt(fd, bootSector, sizeof(bootSector), 0)) {
+        perror("Failed to read boot sector");
+        close(fd);
+        return;
+    }
+
+    //print the size of the image file
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to get image file size");
+        close(fd);
+        return;
+    }
+
+    //populate all values for an instance of BootSectorInfo
+    BootSectorInfo info;
+    if (!parseBootSector(bootSector, st.st_size, &info)) {
+        close(fd);
+        return;
+    }
+
+    //print all data values
+    printf("Bytes Per Sector: %u\n", info.bytesPerSector);
+    printf("Sectors Per Cluster: %u\n", info.sectorsPerCluster);
+    printf("Root Cluster: %u\n", info.rootCluster);
+    printf("Total # of Clusters in Data Region: %u\n", info.totalClusters);
+    printf("# of Entries in One FAT: %u\n", info.sectorsPerFAT);
+    printf("Size of Image (in bytes): %llu\n", info.sizeOfImage);
+
+    close(fd);
+}
+
+//fucntion to handle ls command
+void listDirectory(int fd, DirectoryContext* context, BootSectorInfo* bsi) {
+    //stream the directory cluster by cluster, exit if it can't be read
+    DirIterator it;
+    if (!dirIterOpen(&it, fd, context->currentCluster, bsi)) {
+        return;
+    }
+
+    //print '.' and '..'
+    const DirEntry* entry;
+    printf(".\n..\n"); 
+    dirPrefetch.count = 0;
+
+    //print all entries unless it was deleted, tombstones are skipped in bulk
+    while ((entry = dirIterScan(&it, DIR_SCAN_LIVE, NULL)) != NULL) {
+        if (entry->name[0] == 0x00) break; 
+        noteSubdirectory(entry, bsi);
+
+        printf("%.11s\n", entry->name); 
+    }
+    dirIterClose(&it);
+}
+
+//function to handle mkdir 
+void createDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
+    //take a free entry, the directory grows when it has none
+    DirSlot where;
+    if (!findFreeSlot(fd, context->currentCluster, &where, bsi)) {
+        printf("No space in current directory to create new directory\n");
+        return;
+    }
+
+    DirEntry newEntry;
+    memset(&newEntry, 0, sizeof(DirEntry)); 
+    strncpy(newEntry.name, dirName, 11); 
+    newEntry.attr = ATTR_DIRECTORY;
+
+    // Assign a new cluster for the directory different from the current one
+    newEntry.firstClusterLow = context->currentCluster + 1; 
+    newEntry.firstClusterHigh = 0;
+    newEntry.fileSize = 0; 
+
+    //if it is created successfully, print a success message
+    if (writeDirEntry(fd, where.cluster, where.slot, &newEntry, bsi)) {
+        dirIndexAdded(context->currentCluster, &newEntry, &where);
+        printf("Directory created successfully\n");
+    } else {
+        forgetDirIndex(context->currentCluster);
+    }
+}
+
+//function to handle the creation of the file
+void createFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
+    //a duplicate anywhere in the chain is caught before anything is written
+    DirIndexEntry existing;
+    if (findDirEntry(fd, context->currentCluster, fileName, DIR_MATCH_ANY, &existing, bsi)) {
+        printf("Error: A file or directory with this name already exists.\n");
+        return;
+    }
+
+    //take a free entry, the directory grows when it has none
+    DirSlot where;
+    if (!findFreeSlot(fd, context->currentCluster, &where, bsi)) {
+        printf("No space in current directory to create new file\n");
+        return;
+    }
+
+    //write the new entry into the free slot
+    DirEntry newEntry;
+    memset(&newEntry, 0, sizeof(DirEntry)); 
+    strncpy(newEntry.name, fileName, 11); 
+    newEntry.attr = 0x00; //file attribute
+    if (writeDirEntry(fd, where.cluster, where.slot, &newEntry, bsi)) {
+        dirIndexAdded(context->currentCluster, &newEntry, &where);
+        printf("File created successfully\n");
+    } else {
+        forgetDirIndex(context->currentCluster);
+    }
+}
+
+//tombstone percentage at which rm and rmdir compact a directory, 0 turns it off
+unsigned int compactRatio = 0;
+
+//true when an open file was found through the entry at this position of the
+//directory. such entries keep their slot
+bool entryIsOpen(uint32_t dirCluster, uint32_t position, const DirEntry* entry) {
+    char formattedName[12];
+    formatEntryName(entry, formattedName);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (openFiles[i].isOpen && openFiles[i].dirCluster == dirCluster &&
+            openFiles[i].dirPosition == position && strcmp(openFiles[i].fileName, formattedName) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//rewrite a directory with its live entries packed at the front, in their order, and
+//give the clusters it no longer needs back to the FAT. entries of open files stay
+//where they are and the gaps in front of them become tombstones
+bool compactDirectory(int fd, uint32_t dirCluster, BootSectorInfo* bsi) {
+    unsigned int perCluster = entriesPerCluster(bsi);
+    size_t clusterSize = clusterBytes(bsi);
+
+    //load the whole chain
+    uint32_t* clusters = NULL;
+    unsigned int count = 0;
+    unsigned int capacity = 0;
+    for (uint32_t c = dirCluster; c >= 2 && c != 0xFFFFFFFF; c = getNextCluster(fd, c, bsi)) {
+        if (count == bsi->totalClusters) {
+            printf("Error: Directory cluster chain loops\n");
+            free(clusters);
+            return false;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            uint32_t* grown = realloc(clusters, capacity * sizeof(uint32_t));
+            if (!grown) {
+                free(clusters);
+                return false;
             }
+            clusters = grown;
+        }
+        clusters[count++] = c;
+    }
+    uint32_t total = count * perCluster;
+    unsigned char* old = malloc((size_t)count * clusterSize);
+    unsigned char* packed = calloc(count, clusterSize);
+    unsigned char* taken = calloc(total ? total : 1, 1);
+    bool ok = count && old && packed && taken;
+    for (unsigned int i = 0; ok && i < count; i++) {
+        const unsigned char* data = borrowCluster(fd, clusters[i], bsi);
+        if (!data) {
+            ok = false;
             break;
         }
+        memcpy(old + (size_t)i * clusterSize, data, clusterSize);
+        releaseCluster(data);
+    }
+    if (!ok) {
+        free(clusters);
+        free(old);
+        free(packed);
+        free(taken);
+        return false;
+    }
+
+    //entries of open files first, then everything else in order into the lowest free slot
+    uint32_t end = 0;
+    while (end < total && old[(size_t)end * DIR_ENTRY_SIZE] != 0x00) end++;
+    uint32_t used = 0;
+    unsigned int live = 0;
+    unsigned int pinned = 0;
+    for (uint32_t p = 0; p < end; p++) {
+        const unsigned char* entry = old + (size_t)p * DIR_ENTRY_SIZE;
+        if (entry[0] != 0xE5 && entryIsOpen(dirCluster, p, (const DirEntry*)entry)) {
+            memcpy(packed + (size_t)p * DIR_ENTRY_SIZE, entry, DIR_ENTRY_SIZE);
+            taken[p] = 1;
+            if (p + 1 > used) used = p + 1;
+            pinned++;
+        }
+    }
+    uint32_t next = 0;
+    for (uint32_t p = 0; p < end; p++) {
+        const unsigned char* entry = old + (size_t)p * DIR_ENTRY_SIZE;
+        if (entry[0] == 0xE5) continue;
+        live++;
+        if (taken[p] && memcmp(packed + (size_t)p * DIR_ENTRY_SIZE, entry, DIR_ENTRY_SIZE) == 0) continue;
+        while (taken[next]) next++;
+        memcpy(packed + (size_t)next * DIR_ENTRY_SIZE, entry, DIR_ENTRY_SIZE);
+        taken[next] = 1;
+        if (next + 1 > used) used = next + 1;
+    }
+    for (uint32_t p = 0; p < used; p++) {
+        if (!taken[p]) packed[(size_t)p * DIR_ENTRY_SIZE] = 0xE5;
+    }
+
+    //write the clusters that changed, then cut the chain after the last one needed
+    unsigned int needed = used ? (used + perCluster - 1) / perCluster : 1;
+    for (unsigned int i = 0; ok && i < needed; i++) {
+        size_t offset = (size_t)i * clusterSize;
+        if (memcmp(old + offset, packed + offset, clusterSize) != 0) {
+            unsigned char* data = (unsigned char*)borrowCluster(fd, clusters[i], bsi);
+            if (!data) {
+                ok = false;
+                break;
+            }
+            memcpy(data, packed + offset, clusterSize);
+            ok = releaseDirtyCluster(fd, clusters[i], data, bsi);
+        }
+    }
+    if (ok && needed < count) {
+        ok = setFatEntry(fd, clusters[needed - 1], 0x0FFFFFFF, bsi);
+        for (unsigned int i = needed; ok && i < count; i++) {
+            ok = freeCluster(fd, clusters[i], bsi);
+        }
+    }
+
+    //slots moved, the index is rebuilt on the next lookup. names didn't change
+    forgetDirIndex(dirCluster);
+    if (ok) {
+        printf("Compacted directory: %u entries kept (%u in place for open files), %u tombstones removed, "
+               "%u clusters released\n", live, pinned, end - used, count - needed);
+    }
+    free(clusters);
+    free(old);
+    free(packed);
+    free(taken);
+    return ok;
+}
+
+//compact after a removal once tombstones make up compactRatio percent of the directory
+void maybeCompact(int fd, uint32_t dirCluster, BootSectorInfo* bsi) {
+    DirIndex* index = compactRatio ? findDirIndex(dirCluster) : NULL;
+    if (!index || index->tombstoneCount < entriesPerCluster(bsi) ||
+        (unsigned long long)index->tombstoneCount * 100 < (unsigned long long)compactRatio * index->endPosition) {
+        return;
+    }
+    compactDirectory(fd, dirCluster, bsi);
+}
+
+//function to handle rm
+void removeFile(int fd, const char* fileName, DirectoryContext* context, BootSectorInfo* bsi) {
+    //find the entry to delete
+    DirIndexEntry found;
+    if (!findDirEntry(fd, context->currentCluster, fileName, DIR_MATCH_ANY, &found, bsi)) {
+        printf("Error: File not found.\n");
+        return;
+    }
+
+    //mark the entry as deleted and print message
+    if (deleteDirEntry(fd, found.cluster, found.slot, bsi)) {
+        dirIndexRemoved(context->currentCluster, found.name, found.position);
+        dentryRemoved(context->currentCluster, found.name);
+        printf("File removed successfully\n");
+        maybeCompact(fd, context->currentCluster, bsi);
+    }
+}
+
+//function to handle rmdir
+void removeDirectory(int fd, const char* dirName, DirectoryContext* context, BootSectorInfo* bsi) {
+    if (strcmp(dirName, ".") == 0 || strcmp(dirName, "..") == 0) {
+        printf("Error: Cannot remove '.' or '..'\n");
+        return;
     }
 
-    if (!found) {
+    //search for the directory, ignoring files with the same name
+    DirIndexEntry found;
+    if (!findDirEntry(fd, context->currentCluster, dirName, DIR_MATCH_DIRECTORY, &found, bsi)) {
         printf("Error: Directory not found.\n");
-    } else if (!isEmpty) {
+        return;
+    }
+
+    //check every cluster of the directory for live entries
+    if (!directoryIsEmpty(fd, found.firstCluster, bsi)) {
         printf("Error: Directory is not empty or could not be read.\n");
-    } else {
-        //write back the updated buffer to the current directory's cluster
-        off_t offset = ((context->currentCluster - 2) * bsi->sectorsPerCluster + bsi->rootCluster) * bsi->bytesPerSector;
-        if (lseek(fd, offset, SEEK_SET) < 0) {
-            perror("Error seeking to update directory");
-        } else if (write(fd, buffer, bsi->bytesPerSector * bsi->sectorsPerCluster) < 0) {
-            perror("Error writing updated directory");
-        } else {
-            printf("Directory removed successfully\n");
-        }
+        return;
     }
 
-    free(buffer);
+    //mark the directory as deleted, its own index goes with it
+    if (deleteDirEntry(fd, found.cluster, found.slot, bsi)) {
+        dirIndexRemoved(context->currentCluster, found.name, found.position);
+        dentryRemoved(context->currentCluster, found.name);
+        forgetDirIndex(found.firstCluster);
+        DirFilter* removedFilter = findDirFilter(found.firstCluster);
+        if (removedFilter) dropDirFilter(removedFilter);
+        printf("Directory removed successfully\n");
+        maybeCompact(fd, context->currentCluster, bsi);
+    }
 }
 
 void initializeOpenFiles() {
@@ -541,66 +3594,36 @@ void openFile(int fd, const char* fileName, const char* mode, DirectoryContext*
         return;
     }
 
-    //set flags based on mode
-    int flags = -1;
-    if (strcmp(mode, "-r") == 0) flags = 0;
-    else if (strcmp(mode, "-w") == 0) flags = 1;
-    else if (strcmp(mode, "-rw") == 0 || strcmp(mode, "-wr") == 0) flags = 2;
-
-    if (flags == -1) {
-        printf("Error: Invalid mode.\n");
-        return;
-    }
-
-    //find the file in the directory
-    unsigned char* buffer = malloc(bsi->bytesPerSector * bsi->sectorsPerCluster);
-    if (!buffer) {
-        printf("Failed to allocate memory for reading cluster\n");
-        return;
-    }
-    if (!readCluster(fd, context->currentCluster, buffer, bsi)) {
-        free(buffer);
-        return;
-    }
-
-    DirEntry* entry = (DirEntry*)buffer;
-    int entriesCount = (bsi->bytesPerSector * bsi->sectorsPerCluster) / sizeof(DirEntry);
-    bool found = false;
-
-    //format the name and search for the correct entry
-    for (int i = 0; i < entriesCount; i++, entry++) {
-        if (entry->name[0] == 0x00) break; 
-        if ((unsigned char)entry->name[0] == 0xE5) continue; 
+    //set flags based on mode
+    int flags = -1;
+    if (strcmp(mode, "-r") == 0) flags = 0;
+    else if (strcmp(mode, "-w") == 0) flags = 1;
+    else if (strcmp(mode, "-rw") == 0 || strcmp(mode, "-wr") == 0) flags = 2;
 
-        char formattedName[12];
-        strncpy(formattedName, entry->name, 11);
-        formattedName[11] = '\0';
-
-        for (int j = 10; j >= 0; j--) {
-            if (formattedName[j] == ' ') formattedName[j] = '\0';
-            else break;
-        }
-
-        if (strcmp(formattedName, fileName) == 0 && !(entry->attr & ATTR_DIRECTORY)) {
-            openFiles[index].isOpen = true;
-            strncpy(openFiles[index].fileName, fileName, 11);
-            openFiles[index].flags = flags;
-            openFiles[index].offset = 0;
-            openFiles[index].cluster = (entry->firstClusterHigh << 16) | entry->firstClusterLow;
-            openFiles[index].size = entry->fileSize;
-            found = true;
-            break;
-        }
+    if (flags == -1) {
+        printf("Error: Invalid mode.\n");
+        return;
     }
 
-    //print message indicating success or failure
-    if (!found) {
+    //find the file anywhere in the directory's chain
+    DirIndexEntry found;
+    if (!findDirEntry(fd, context->currentCluster, fileName, DIR_MATCH_FILE, &found, bsi)) {
         printf("Error: File not found.\n");
-    } else {
-        printf("File opened successfully: %s\n", fileName);
+        return;
     }
 
-    free(buffer);
+    openFiles[index].isOpen = true;
+    strncpy(openFiles[index].fileName, fileName, 11);
+    openFiles[index].flags = flags;
+    openFiles[index].offset = 0;
+    openFiles[index].cluster = found.firstCluster;
+    openFiles[index].size = found.fileSize;
+    openFiles[index].lastReadEnd = 0;
+    openFiles[index].raWindow = 0;
+    openFiles[index].raEnd = 0;
+    openFiles[index].dirCluster = context->currentCluster;
+    openFiles[index].dirPosition = found.position;
+    printf("File opened successfully: %s\n", fileName);
 }
 
 //function to handles closing of a file
@@ -655,6 +3678,10 @@ void seekFile(const char* fileName, unsigned long newOffset) {
                 printf("Error: Offset is larger than the size of the file.\n");
             } else {
                 openFiles[i].offset = newOffset;
+                //a seek ends the sequential run, the next read starts over
+                openFiles[i].lastReadEnd = ULONG_MAX;
+                openFiles[i].raWindow = 0;
+                openFiles[i].raEnd = 0;
                 printf("Offset set to %lu for file: %s\n", newOffset, fileName);
             }
             break;
@@ -666,6 +3693,87 @@ void seekFile(const char* fileName, unsigned long newOffset) {
     }
 }
 
+#define RA_INITIAL_CLUSTERS 4
+#define RA_MAX_CLUSTERS 64
+#define RA_FADVISE_CLUSTERS 16            //windows this big also get a kernel hint
+
+//hint the kernel about the image ranges behind a run of clusters, merging
+//clusters that sit next to each other in the image. both hints start the reads
+//and return without waiting for them
+void adviseClusters(int fd, const unsigned int* clusters, unsigned int count, BootSectorInfo* bsi) {
+    if (imageInRam) {
+        return;
+    }
+    unsigned int clusterSize = clusterBytes(bsi);
+    unsigned int i = 0;
+    while (i < count) {
+        unsigned int run = 1;
+        while (i + run < count && clusters[i + run] == clusters[i] + run) {
+            run++;
+        }
+        off_t offset = clusterOffset(clusters[i], bsi);
+        off_t length = (off_t)run * clusterSize;
+        if (imageMap && clusterInMap(clusters[i] + run - 1, bsi)) {
+            off_t aligned = offset & ~(off_t)(mapPageSize - 1);
+            madvise(imageMap + aligned, length + (offset - aligned), MADV_WILLNEED);
+        } else {
+            posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+        }
+        i += run;
+    }
+}
+
+//grow the handle's window on a sequential read and load the clusters past readEnd
+//into the cache. the next batch is fetched once the reader is halfway through the
+//window already loaded, so a loop of small reads finds its data in memory
+void readAhead(int fd, OpenFile* file, bool sequential, BootSectorInfo* bsi) {
+    if (!clusterCache.capacity || !sequential) {
+        file->raWindow = 0;
+        file->raEnd = 0;
+        return;
+    }
+
+    unsigned int maxWindow = clusterCache.active / 4;
+    if (maxWindow > RA_MAX_CLUSTERS) maxWindow = RA_MAX_CLUSTERS;
+    if (maxWindow < 1) return;
+    file->raWindow = file->raWindow ? file->raWindow * 2 : RA_INITIAL_CLUSTERS;
+    if (file->raWindow > maxWindow) file->raWindow = maxWindow;
+
+    unsigned int clusterSize = clusterBytes(bsi);
+    unsigned long readEnd = file->offset;
+    unsigned long windowEnd = readEnd + (unsigned long)file->raWindow * clusterSize;
+    if (windowEnd > file->size) windowEnd = file->size;
+    if (file->raEnd < readEnd) file->raEnd = readEnd;
+    if (file->raEnd >= windowEnd ||
+        file->raEnd - readEnd >= (unsigned long)file->raWindow * clusterSize / 2) {
+        return;
+    }
+
+    //the cluster holding raEnd may already be cached from the read itself,
+    //prefetchClusters skips whatever is resident
+    unsigned int first = clusterIndexOf(file->raEnd, bsi);
+    unsigned int count = clusterIndexOf(windowEnd + clusterSize - 1, bsi) - first;
+    unsigned int* clusters = malloc(count * sizeof(unsigned int));
+    if (!clusters) {
+        return;
+    }
+    unsigned int found = 0;
+    unsigned int cluster = getFileCluster(fd, file->cluster, first, bsi);
+    while (found < count && cluster >= 2 && cluster < 0x0FFFFFF8) {
+        clusters[found++] = cluster;
+        if (found < count) cluster = getNextCluster(fd, cluster, bsi);
+    }
+
+    if (file->raWindow >= RA_FADVISE_CLUSTERS) {
+        adviseClusters(fd, clusters, found, bsi);
+    }
+    unsigned long long before = clusterCache.misses;
+    prefetchClusters(fd, clusters, found, bsi);
+    clusterCache.readAheads += clusterCache.misses - before;
+    free(clusters);
+    file->raEnd = windowEnd;
+}
+
 //function to handle reading of a file
 void readFile(int fd, const char* fileName, unsigned int size, BootSectorInfo* bsi) {
     bool fileFound = false;
@@ -676,66 +3784,725 @@ void readFile(int fd, const char* fileName, unsigned int size, BootSectorInfo* b
                 return;
             }
             fileFound = true;
-            unsigned char* buffer = malloc(size);
-            if (!buffer) {
-                printf("Memory allocation failed\n");
-                return;
-            }
+            bool sequential = openFiles[i].offset == openFiles[i].lastReadEnd;
             unsigned int readSize = size;
             if (openFiles[i].offset + size > openFiles[i].size) {
                 readSize = openFiles[i].size - openFiles[i].offset;
             }
 
-            //calculate starting sector and offset within the sector
-            unsigned int cluster = openFiles[i].cluster;
-            unsigned int sectorOffset = (openFiles[i].offset / bsi->bytesPerSector) % bsi->sectorsPerCluster;
-            unsigned int byteOffset = openFiles[i].offset % bsi->bytesPerSector;
+            //the output goes through a bounded buffer of whole clusters instead of
+            //one allocation the size of the request
+            unsigned int clusterSize = clusterBytes(bsi);
+            unsigned int chunkSize = READ_CHUNK_BYTES / clusterSize * clusterSize;
+            if (chunkSize < clusterSize) chunkSize = clusterSize;
+            if (chunkSize > readSize) chunkSize = readSize;
+            unsigned char* buffer = malloc(chunkSize ? chunkSize : 1);
+            if (!buffer) {
+                printf("Memory allocation failed\n");
+                return;
+            }
+            unsigned int filled = 0;
+
+            //calculate starting cluster and offset within the cluster
+            unsigned int clusterIndex = clusterIndexOf(openFiles[i].offset, bsi);
+            unsigned int cluster = getFileCluster(fd, openFiles[i].cluster, clusterIndex, bsi);
+            unsigned int byteOffset = offsetInCluster(openFiles[i].offset, bsi);
             unsigned int bytesRead = 0;
+            bool direct = directFd >= 0 && readSize >= DIRECT_MIN_BYTES;
+
+            //issue the reads for every cluster of the request together
+            unsigned int clusterCount = clusterIndexOf((uint64_t)byteOffset + readSize + clusterSize - 1, bsi);
+            if (clusterCount > clusterCache.active) {
+                clusterCount = clusterCache.active;
+            }
+            if (!direct && clusterCache.capacity && clusterCount > 1) {
+                unsigned int* clusters = malloc(clusterCount * sizeof(unsigned int));
+                if (clusters) {
+                    unsigned int found = 0;
+                    unsigned int next = cluster;
+                    while (found < clusterCount && next >= 2 && next != 0xFFFFFFFF) {
+                        clusters[found++] = next;
+                        next = getNextCluster(fd, next, bsi);
+                    }
+                    prefetchClusters(fd, clusters, found, bsi);
+                    free(clusters);
+                }
+            }
 
-            //seek file and attempt tor read - calculate te number of bytes needed to read
+            //copy the file out one cluster at a time, clusters come through the cache
             while (bytesRead < readSize) {
-                unsigned long long sector = ((cluster - 2) * bsi->sectorsPerCluster) + bsi->rootCluster + sectorOffset;
-                off_t sectorStart = sector * bsi->bytesPerSector;
+                if (cluster < 2 || cluster == 0xFFFFFFFF) {
+                    printf("Error: Failed to find next cluster.\n");
+                    break;
+                }
+
+                //whole clusters of a large read bypass the cache, the unaligned
+                //head and tail and anything already cached stay buffered
+                if (direct && directFd >= 0 && byteOffset == 0 && readSize - bytesRead >= clusterSize &&
+                    !clusterCached(cluster)) {
+                    if (chunkSize - filled < clusterSize) {
+                        printf("%.*s", filled, buffer);
+                        filled = 0;
+                    }
+                    unsigned int maxClusters = clusterIndexOf(readSize - bytesRead, bsi);
+                    if (maxClusters > clusterIndexOf(chunkSize - filled, bsi)) {
+                        maxClusters = clusterIndexOf(chunkSize - filled, bsi);
+                    }
+                    unsigned int next;
+                    unsigned int copied = readDirectRun(fd, cluster, buffer + filled, maxClusters, &next, bsi);
+                    if (copied > 0) {
+                        bytesRead += copied * clusterSize;
+                        filled += copied * clusterSize;
+                        cluster = next;
+                        continue;
+                    }
+                }
 
-                if (lseek(fd, sectorStart + byteOffset, SEEK_SET) < 0) {
-                    perror("Error seeking file");
+                const unsigned char* data = borrowDataCluster(fd, cluster, bsi);
+                if (!data) {
                     free(buffer);
                     return;
                 }
 
-                unsigned int bytesToRead = bsi->bytesPerSector - byteOffset;
-                if (bytesRead + bytesToRead > readSize) {
-                    bytesToRead = readSize - bytesRead;
-                }
+                unsigned int bytesToRead = clusterSize - byteOffset;
+                if (bytesRead + bytesToRead > readSize) {
+                    bytesToRead = readSize - bytesRead;
+                }
+                if (filled + bytesToRead > chunkSize) {
+                    printf("%.*s", filled, buffer);
+                    filled = 0;
+                }
+                memcpy(buffer + filled, data + byteOffset, bytesToRead);
+                releaseCluster(data);
+
+                //reset byte offset for the next cluster
+                bytesRead += bytesToRead;
+                filled += bytesToRead;
+                byteOffset = 0;
+                if (bytesRead < readSize) {
+                    cluster = getNextCluster(fd, cluster, bsi);
+                }
+            }
+
+            printf("%.*s", filled, buffer);
+            free(buffer);
+
+            //update offset
+            openFiles[i].offset += bytesRead;
+            openFiles[i].lastReadEnd = openFiles[i].offset;
+            if (!direct) {
+                readAhead(fd, &openFiles[i], sequential, bsi);
+            }
+            printf("\nRead %u bytes from file: %s\n", bytesRead, fileName);
+            break;
+        }
+    }
+
+    if (!fileFound) {
+        printf("Error: File not found or not opened.\n");
+    }
+}
+
+//number of FAT sectors covered by a page, the last page may be short
+unsigned int fatPageSectors(unsigned int page, BootSectorInfo* bsi) {
+    unsigned int first = page * FAT_PAGE_SECTORS;
+    if (first + FAT_PAGE_SECTORS > bsi->sectorsPerFAT) {
+        return bsi->sectorsPerFAT - first;
+    }
+    return FAT_PAGE_SECTORS;
+}
+
+//write back the dirty sectors of one page, one write per consecutive run
+bool flushFatPage(int fd, unsigned int page, BootSectorInfo* bsi) {
+    unsigned char* raw = (unsigned char*)fatTable.pages[page];
+    unsigned int first = page * FAT_PAGE_SECTORS;
+    unsigned int end = first + fatPageSectors(page, bsi);
+    unsigned int sector = first;
+
+    while (sector < end) {
+        if (!BIT_TEST(fatTable.dirtySectors, sector)) {
+            sector++;
+            continue;
+        }
+
+        unsigned int runEnd = sector;
+        while (runEnd < end && BIT_TEST(fatTable.dirtySectors, runEnd)) {
+            runEnd++;
+        }
+
+        //every FAT copy gets the same sectors so the mirrors stay identical
+        size_t runStart = sectorToOffset(sector - first, bsi);
+        size_t runBytes = sectorToOffset(runEnd - sector, bsi);
+        for (unsigned int copy = 0; copy < bsi->numFATs; copy++) {
+            off_t position = fatOffsetInImage(bsi) + sectorToOffset((uint64_t)copy * bsi->sectorsPerFAT + sector, bsi);
+            if (!writeAt(fd, raw + runStart, runBytes, position)) {
+                perror("Error writing FAT");
+                return false;
+            }
+        }
+        sharedWroteFat(fd, raw + runStart, runBytes, sectorToOffset(sector, bsi));
+
+        for (unsigned int i = sector; i < runEnd; i++) {
+            BIT_CLEAR(fatTable.dirtySectors, i);
+            fatTable.dirtyCount--;
+        }
+        sector = runEnd;
+    }
+    return true;
+}
+
+//pick a victim with the clock sweep, write it back if needed and release it
+bool evictFatPage(int fd, BootSectorInfo* bsi) {
+    //two full turns is enough to find a page whose referenced bit was cleared
+    for (unsigned int scanned = 0; scanned < fatTable.numPages * 2; scanned++) {
+        unsigned int page = fatTable.clockHand;
+        fatTable.clockHand = (fatTable.clockHand + 1) % fatTable.numPages;
+
+        if (!BIT_TEST(fatTable.loaded, page)) continue;
+        if (BIT_TEST(fatTable.referenced, page)) {
+            BIT_CLEAR(fatTable.referenced, page);
+            continue;
+        }
+
+        if (!flushFatPage(fd, page, bsi)) {
+            return false;
+        }
+        free(fatTable.pages[page]);
+        fatTable.pages[page] = NULL;
+        BIT_CLEAR(fatTable.loaded, page);
+        fatTable.loadedPages--;
+        return true;
+    }
+    return false;
+}
+
+//return the page holding FAT entries for page, faulting it in on first touch
+uint32_t* getFatPage(int fd, unsigned int page, BootSectorInfo* bsi) {
+    if (BIT_TEST(fatTable.loaded, page)) {
+        fatTable.hits++;
+        BIT_SET(fatTable.referenced, page);
+        return fatTable.pages[page];
+    }
+
+    fatTable.misses++;
+    while (fatTable.loadedPages >= fatTable.maxPages) {
+        if (!evictFatPage(fd, bsi)) {
+            printf("Error: Could not evict a FAT page\n");
+            return NULL;
+        }
+    }
+
+    size_t pageBytes = (size_t)FAT_PAGE_SECTORS * bsi->bytesPerSector;
+    unsigned char* raw = calloc(1, pageBytes);
+    if (!raw) {
+        printf("Failed to allocate memory for FAT page\n");
+        return NULL;
+    }
+
+    off_t position = fatOffsetInImage(bsi) + (off_t)page * pageBytes;
+    size_t readBytes = (size_t)fatPageSectors(page, bsi) * bsi->bytesPerSector;
+    if (!sharedReadFat(raw, readBytes, (uint64_t)page * pageBytes) && !readAt(fd, raw, readBytes, position)) {
+        perror("Error reading FAT");
+        free(raw);
+        return NULL;
+    }
+
+    fatTable.pages[page] = (uint32_t*)raw;
+    BIT_SET(fatTable.loaded, page);
+    BIT_SET(fatTable.referenced, page);
+    fatTable.loadedPages++;
+    return fatTable.pages[page];
+}
+
+//set up the page table. the FAT is read up front only when it fits under the cap,
+//otherwise pages are faulted in as chains are walked
+bool loadFatTable(int fd, BootSectorInfo* bsi) {
+    size_t pageBytes = (size_t)FAT_PAGE_SECTORS * bsi->bytesPerSector;
+    unsigned long long fatBytes = (unsigned long long)bsi->sectorsPerFAT * bsi->bytesPerSector;
+
+    fatTable.numPages = (bsi->sectorsPerFAT + FAT_PAGE_SECTORS - 1) / FAT_PAGE_SECTORS;
+    fatTable.entriesPerPage = pageBytes / 4;
+    fatTable.numEntries = fatBytes / 4;
+    fatTable.maxPages = fatCacheLimit / pageBytes;
+    if (fatTable.maxPages < 1) fatTable.maxPages = 1;
+
+    fatTable.pages = calloc(fatTable.numPages, sizeof(uint32_t*));
+    fatTable.loaded = calloc((fatTable.numPages + 7) / 8, 1);
+    fatTable.referenced = calloc((fatTable.numPages + 7) / 8, 1);
+    fatTable.dirtySectors = calloc((bsi->sectorsPerFAT + 7) / 8, 1);
+    if (!fatTable.pages || !fatTable.loaded || !fatTable.referenced || !fatTable.dirtySectors) {
+        printf("Failed to allocate memory for FAT table\n");
+        freeFatTable();
+        return false;
+    }
+
+    if (fatTable.maxPages < fatTable.numPages) {
+        return true;
+    }
+
+    //whole FAT fits, take it from the shared cache or read it in one go and share it
+    fatTable.contiguous = calloc(fatTable.numPages, pageBytes);
+    if (fatTable.contiguous && !sharedReadFat(fatTable.contiguous, fatBytes, 0)) {
+        uint64_t generation = sharedCache.header ? sharedGeneration() : 0;
+        if (!readAt(fd, fatTable.contiguous, fatBytes, fatOffsetInImage(bsi))) {
+            free(fatTable.contiguous);
+            fatTable.contiguous = NULL;
+        } else {
+            sharedStoreFat(fatTable.contiguous, fatBytes, generation);
+        }
+    }
+    if (!fatTable.contiguous) {
+        return true;
+    }
+    for (unsigned int page = 0; page < fatTable.numPages; page++) {
+        fatTable.pages[page] = (uint32_t*)(fatTable.contiguous + (size_t)page * pageBytes);
+        BIT_SET(fatTable.loaded, page);
+    }
+    fatTable.loadedPages = fatTable.numPages;
+    return true;
+}
+
+//give every page of a fully resident FAT its own allocation so pages can be
+//evicted one at a time
+bool splitContiguousFat(BootSectorInfo* bsi) {
+    size_t pageBytes = (size_t)FAT_PAGE_SECTORS * bsi->bytesPerSector;
+    uint32_t** copies = calloc(fatTable.numPages, sizeof(uint32_t*));
+    if (!copies) {
+        return false;
+    }
+    for (unsigned int page = 0; page < fatTable.numPages; page++) {
+        copies[page] = malloc(pageBytes);
+        if (!copies[page]) {
+            for (unsigned int i = 0; i < page; i++) free(copies[i]);
+            free(copies);
+            return false;
+        }
+        memcpy(copies[page], fatTable.pages[page], pageBytes);
+    }
+    for (unsigned int page = 0; page < fatTable.numPages; page++) {
+        fatTable.pages[page] = copies[page];
+    }
+    free(copies);
+    free(fatTable.contiguous);
+    fatTable.contiguous = NULL;
+    return true;
+}
+
+//change the FAT cache cap, evicting pages down to it
+bool resizeFatCache(int fd, unsigned long long limit, BootSectorInfo* bsi) {
+    if (!fatTable.pages) {
+        return true;
+    }
+    size_t pageBytes = (size_t)FAT_PAGE_SECTORS * bsi->bytesPerSector;
+    unsigned int maxPages = limit / pageBytes;
+    if (maxPages < 1) maxPages = 1;
+
+    if (fatTable.contiguous && maxPages < fatTable.numPages && !splitContiguousFat(bsi)) {
+        return false;
+    }
+    fatTable.maxPages = maxPages;
+    while (fatTable.loadedPages > fatTable.maxPages) {
+        if (!evictFatPage(fd, bsi)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//read one FAT entry through the page cache
+bool getFatEntry(int fd, unsigned int cluster, unsigned int* value, BootSectorInfo* bsi) {
+    if (cluster >= fatTable.numEntries) {
+        fprintf(stderr, "Invalid cluster number: %u\n", cluster);
+        return false;
+    }
+    uint32_t* page = getFatPage(fd, cluster / fatTable.entriesPerPage, bsi);
+    if (!page) {
+        return false;
+    }
+    *value = page[cluster % fatTable.entriesPerPage];
+    return true;
+}
+
+//update one FAT entry in memory and mark its sector for write back
+void updateExtentIndex(unsigned int cluster, unsigned int oldValue, unsigned int value);
+
+bool setFatEntry(int fd, unsigned int cluster, unsigned int value, BootSectorInfo* bsi) {
+    if (!fatTable.pages || cluster >= fatTable.numEntries) {
+        fprintf(stderr, "Invalid cluster number: %u\n", cluster);
+        return false;
+    }
+    uint32_t* page = getFatPage(fd, cluster / fatTable.entriesPerPage, bsi);
+    if (!page) {
+        return false;
+    }
+
+    //the top 4 bits of a FAT32 entry are reserved and must be preserved
+    uint32_t* entry = &page[cluster % fatTable.entriesPerPage];
+    updateExtentIndex(cluster, *entry & 0x0FFFFFFF, value & 0x0FFFFFFF);
+    *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+
+    unsigned int sector = fatEntrySector(cluster, bsi);
+    if (!BIT_TEST(fatTable.dirtySectors, sector)) {
+        BIT_SET(fatTable.dirtySectors, sector);
+        if (fatTable.dirtyCount++ == 0) {
+            fatTable.dirtySince = monotonicSeconds();
+        }
+    }
+    return true;
+}
+
+//cluster allocator. free clusters are found by a circular scan of the FAT from
+//where the last allocation left off, freed clusters pull the start back down
+unsigned int nextFreeCluster = 2;
+
+//claim a free cluster and mark it as the end of a chain, 0 when there is none
+unsigned int allocateCluster(int fd, BootSectorInfo* bsi) {
+    unsigned int end = bsi->totalClusters + 2;
+    if (end > fatTable.numEntries) end = fatTable.numEntries;
+    if (!fatTable.pages || end <= 2) {
+        printf("Error: No FAT to allocate clusters from\n");
+        return 0;
+    }
+
+    unsigned int cluster = nextFreeCluster >= 2 && nextFreeCluster < end ? nextFreeCluster : 2;
+    for (unsigned int n = 2; n < end; n++) {
+        unsigned int value;
+        if (!getFatEntry(fd, cluster, &value, bsi)) {
+            return 0;
+        }
+        if ((value & 0x0FFFFFFF) == 0) {
+            if (!setFatEntry(fd, cluster, 0x0FFFFFFF, bsi)) {
+                return 0;
+            }
+            nextFreeCluster = cluster + 1;
+            return cluster;
+        }
+        if (++cluster == end) cluster = 2;
+    }
+    printf("Error: No free clusters left\n");
+    return 0;
+}
+
+//give a cluster back, the next allocation looks there first
+bool freeCluster(int fd, unsigned int cluster, BootSectorInfo* bsi) {
+    if (!setFatEntry(fd, cluster, 0, bsi)) {
+        return false;
+    }
+    if (cluster < nextFreeCluster) nextFreeCluster = cluster;
+    return true;
+}
+
+//write every dirty FAT sector back to the image
+bool flushFatTable(int fd, BootSectorInfo* bsi) {
+    if (!fatTable.pages || fatTable.dirtyCount == 0) {
+        return true;
+    }
+    for (unsigned int page = 0; page < fatTable.numPages; page++) {
+        if (BIT_TEST(fatTable.loaded, page) && !flushFatPage(fd, page, bsi)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void freeFatTable() {
+    if (fatTable.pages && !fatTable.contiguous) {
+        for (unsigned int page = 0; page < fatTable.numPages; page++) {
+            free(fatTable.pages[page]);
+        }
+    }
+    free(fatTable.contiguous);
+    free(fatTable.pages);
+    free(fatTable.loaded);
+    free(fatTable.referenced);
+    free(fatTable.dirtySectors);
+    memset(&fatTable, 0, sizeof(fatTable));
+}
+
+void dropExtentChains() {
+    for (int i = 0; i < MAX_EXTENT_CHAINS; i++) {
+        free(extentIndex.chains[i].starts);
+        free(extentIndex.chains[i].offsets);
+        memset(&extentIndex.chains[i], 0, sizeof(ExtentChain));
+    }
+}
+
+//scan the whole FAT once and collapse every chain into runs of consecutive clusters
+bool buildExtentIndex(int fd, BootSectorInfo* bsi) {
+    dropExtentChains();
+    free(extentIndex.runs);
+    extentIndex.runs = NULL;
+    extentIndex.count = extentIndex.capacity = 0;
+    extentIndex.valid = false;
+
+    unsigned int capacity = 1024;
+    FatExtent* runs = malloc(capacity * sizeof(FatExtent));
+    if (!runs) {
+        printf("Failed to allocate memory for extent index\n");
+        return false;
+    }
+
+    unsigned int count = 0;
+    unsigned int cluster = 2;
+    while (cluster < fatTable.numEntries) {
+        unsigned int value;
+        if (!getFatEntry(fd, cluster, &value, bsi)) {
+            free(runs);
+            return false;
+        }
+        value &= 0x0FFFFFFF;
+
+        //free and bad clusters are not part of any chain
+        if (value == 0 || value == 0x0FFFFFF7) {
+            cluster++;
+            continue;
+        }
+
+        //extend the run while each cluster points at its neighbour. a link into a
+        //free or bad cluster ends it, that cluster is in no chain
+        unsigned int start = cluster;
+        while (value == cluster + 1 && cluster + 1 < fatTable.numEntries) {
+            unsigned int next;
+            if (!getFatEntry(fd, cluster + 1, &next, bsi)) {
+                free(runs);
+                return false;
+            }
+            next &= 0x0FFFFFFF;
+            if (next == 0 || next == 0x0FFFFFF7) {
+                break;
+            }
+            cluster++;
+            value = next;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            FatExtent* grown = realloc(runs, capacity * sizeof(FatExtent));
+            if (!grown) {
+                printf("Failed to allocate memory for extent index\n");
+                free(runs);
+                return false;
+            }
+            runs = grown;
+        }
+        runs[count].start = start;
+        runs[count].length = cluster - start + 1;
+        runs[count].next = (value >= 0x0FFFFFF8) ? 0xFFFFFFFF : value;
+        count++;
+        cluster++;
+    }
+
+    extentIndex.runs = runs;
+    extentIndex.count = count;
+    extentIndex.capacity = capacity;
+    extentIndex.valid = true;
+    return true;
+}
+
+void invalidateExtentIndex() {
+    extentIndex.valid = false;
+    dropExtentChains();
+}
+
+//first run that starts after cluster
+unsigned int extentUpperBound(unsigned int cluster) {
+    unsigned int low = 0;
+    unsigned int high = extentIndex.count;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (extentIndex.runs[mid].start <= cluster) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+//replace removeCount runs at position with insertCount new ones
+bool spliceExtents(unsigned int position, unsigned int removeCount, const FatExtent* insert, unsigned int insertCount) {
+    unsigned int count = extentIndex.count - removeCount + insertCount;
+    if (count > extentIndex.capacity) {
+        unsigned int capacity = extentIndex.capacity ? extentIndex.capacity * 2 : 1024;
+        FatExtent* grown = realloc(extentIndex.runs, capacity * sizeof(FatExtent));
+        if (!grown) {
+            return false;
+        }
+        extentIndex.runs = grown;
+        extentIndex.capacity = capacity;
+    }
+    memmove(&extentIndex.runs[position + insertCount], &extentIndex.runs[position + removeCount],
+            (extentIndex.count - position - removeCount) * sizeof(FatExtent));
+    if (insertCount) {
+        memcpy(&extentIndex.runs[position], insert, insertCount * sizeof(FatExtent));
+    }
+    extentIndex.count = count;
+    return true;
+}
+
+//a FAT entry changed from oldValue to value. the run holding cluster is split
+//around it, then cluster is joined back to its neighbours where the chain runs on
+//into them, which leaves the runs exactly as a full rebuild would
+void updateExtentIndex(unsigned int cluster, unsigned int oldValue, unsigned int value) {
+    if (!extentIndex.valid || oldValue == value) {
+        return;
+    }
+    bool wasChained = oldValue != 0 && oldValue != 0x0FFFFFF7;
+    bool chained = value != 0 && value != 0x0FFFFFF7;
+    if (wasChained) {
+        dropExtentChains();
+    }
+
+    FatExtent pieces[3];
+    unsigned int numPieces = 0;
+    unsigned int position = extentUpperBound(cluster);
+    unsigned int removeCount = 0;
+    if (wasChained) {
+        FatExtent* run = position > 0 ? &extentIndex.runs[position - 1] : NULL;
+        if (!run || cluster >= run->start + run->length) {
+            invalidateExtentIndex();
+            return;
+        }
+        position--;
+        removeCount = 1;
+        if (cluster > run->start) {
+            pieces[numPieces++] = (FatExtent){ run->start, cluster - run->start, cluster };
+        }
+    }
+    unsigned int self = position + numPieces;
+    if (chained) {
+        pieces[numPieces++] = (FatExtent){ cluster, 1, value >= 0x0FFFFFF8 ? 0xFFFFFFFF : value };
+    }
+    if (wasChained) {
+        FatExtent* run = &extentIndex.runs[position];
+        if (cluster + 1 < run->start + run->length) {
+            pieces[numPieces++] = (FatExtent){ cluster + 1, run->start + run->length - cluster - 1, run->next };
+        }
+    }
+    if (!spliceExtents(position, removeCount, pieces, numPieces)) {
+        invalidateExtentIndex();
+        return;
+    }
+    if (!chained) {
+        return;
+    }
+
+    //join the run before when it ends at cluster-1 and points at cluster
+    FatExtent* runs = extentIndex.runs;
+    if (self > 0 && runs[self - 1].start + runs[self - 1].length == cluster && runs[self - 1].next == cluster) {
+        runs[self - 1].length++;
+        runs[self - 1].next = runs[self].next;
+        spliceExtents(self, 1, NULL, 0);
+        self--;
+    }
+    //and the run after when cluster points at its start
+    if (self + 1 < extentIndex.count && runs[self].next == cluster + 1 && runs[self + 1].start == cluster + 1) {
+        runs[self].length += runs[self + 1].length;
+        runs[self].next = runs[self + 1].next;
+        spliceExtents(self + 1, 1, NULL, 0);
+    }
+}
+
+//binary search for the run containing cluster, NULL if it isn't in a chain
+FatExtent* findExtent(int fd, unsigned int cluster, BootSectorInfo* bsi) {
+    if (!extentIndex.valid && !buildExtentIndex(fd, bsi)) {
+        return NULL;
+    }
+
+    unsigned int low = 0;
+    unsigned int high = extentIndex.count;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        FatExtent* run = &extentIndex.runs[mid];
+        if (cluster < run->start) {
+            high = mid;
+        } else if (cluster >= run->start + run->length) {
+            low = mid + 1;
+        } else {
+            return run;
+        }
+    }
+    return NULL;
+}
+
+void freeExtentIndex() {
+    dropExtentChains();
+    free(extentIndex.runs);
+    memset(&extentIndex, 0, sizeof(extentIndex));
+}
 
-                if (read(fd, buffer + bytesRead, bytesToRead) < 0) {
-                    perror("Error reading file");
-                    free(buffer);
-                    return;
-                }
+//the runs of the chain starting at firstCluster with their offsets, built on
+//first use and kept until a cluster in some chain changes. NULL when the chain
+//leaves the index (a link to a free cluster or a loop)
+ExtentChain* findExtentChain(int fd, unsigned int firstCluster, BootSectorInfo* bsi) {
+    ExtentChain* chain = NULL;
+    for (int i = 0; i < MAX_EXTENT_CHAINS; i++) {
+        ExtentChain* candidate = &extentIndex.chains[i];
+        if (candidate->firstCluster == firstCluster) {
+            candidate->lastUsed = ++extentIndex.chainClock;
+            return candidate;
+        }
+        if (!chain || candidate->lastUsed < chain->lastUsed) {
+            chain = candidate;
+        }
+    }
 
-                //reset byte offset for the next secto
-                bytesRead += bytesToRead;
-                byteOffset = 0;
-                sectorOffset++;
-                if (sectorOffset >= bsi->sectorsPerCluster) {
-                    sectorOffset = 0;
-                    cluster = getNextCluster(fd, cluster, bsi);
-                }
+    unsigned int count = 0;
+    unsigned int capacity = 0;
+    unsigned int total = 0;
+    unsigned int* starts = NULL;
+    unsigned int* offsets = NULL;
+    unsigned int cluster = firstCluster;
+    while (cluster != 0xFFFFFFFF) {
+        FatExtent* run = findExtent(fd, cluster, bsi);
+        if (!run || total >= fatTable.numEntries) {
+            free(starts);
+            free(offsets);
+            return NULL;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            unsigned int* grownStarts = realloc(starts, capacity * sizeof(unsigned int));
+            if (grownStarts) starts = grownStarts;
+            unsigned int* grownOffsets = realloc(offsets, capacity * sizeof(unsigned int));
+            if (grownOffsets) offsets = grownOffsets;
+            if (!grownStarts || !grownOffsets) {
+                free(starts);
+                free(offsets);
+                return NULL;
             }
+        }
+        starts[count] = cluster;
+        offsets[count] = total;
+        count++;
+        total += run->start + run->length - cluster;
+        cluster = run->next;
+    }
 
-            printf("%.*s", bytesRead, buffer); 
-            free(buffer);
+    free(chain->starts);
+    free(chain->offsets);
+    chain->firstCluster = firstCluster;
+    chain->count = count;
+    chain->total = total;
+    chain->starts = starts;
+    chain->offsets = offsets;
+    chain->lastUsed = ++extentIndex.chainClock;
+    return chain;
+}
 
-            //update offset
-            openFiles[i].offset += bytesRead;
-            printf("\nRead %u bytes from file: %s\n", bytesRead, fileName);
-            break;
-        }
+//handle the extents command: rebuild the index and compare it to the flat table
+void printExtentStats(int fd, BootSectorInfo* bsi) {
+    if (!buildExtentIndex(fd, bsi)) {
+        return;
     }
 
-    if (!fileFound) {
-        printf("Error: File not found or not opened.\n");
+    unsigned long long flatBytes = (unsigned long long)fatTable.numEntries * 4;
+    unsigned long long extentBytes = (unsigned long long)extentIndex.count * sizeof(FatExtent);
+    printf("Runs: %u\n", extentIndex.count);
+    printf("Extent index size (in bytes): %llu\n", extentBytes);
+    printf("Flat FAT size (in bytes): %llu\n", flatBytes);
+    if (flatBytes > 0) {
+        printf("Memory saved: %.1f%%\n", 100.0 - (100.0 * extentBytes / flatBytes));
     }
 }
 
@@ -746,31 +4513,40 @@ unsigned int getNextCluster(int fd, unsigned int currentCluster, BootSectorInfo*
         return 0xFFFFFFFF; //error
     }
 
-    //FAT32 cluster entry is 4 bytes
-    unsigned int fatOffset = currentCluster * 4;
-    unsigned int fatSector = bsi->rootCluster + (fatOffset / bsi->bytesPerSector);
-    unsigned int entOffset = fatOffset % bsi->bytesPerSector;
+    if (useExtentIndex && fatTable.pages) {
+        FatExtent* run = findExtent(fd, currentCluster, bsi);
+        if (run) {
+            if (currentCluster + 1 < run->start + run->length) {
+                return currentCluster + 1;
+            }
+            return run->next;
+        }
+    }
 
-    //buffer to read the entry
-    unsigned char buffer[4]; 
+    unsigned int nextCluster;
+    if (fatTable.pages) {
+        //served from the FAT page cache, faulting the page in if needed
+        if (!getFatEntry(fd, currentCluster, &nextCluster, bsi)) {
+            return 0xFFFFFFFF;
+        }
+        nextCluster &= 0x0FFFFFFF;
+    } else {
+        //FAT32 cluster entry is 4 bytes
+        unsigned char buffer[4]; 
 
-    //calculate the position to seek
-    off_t position = fatSector * bsi->bytesPerSector + entOffset;
+        //calculate the position of the entry
+        off_t position = fatEntryOffset(currentCluster, bsi);
 
-    if (lseek(fd, position, SEEK_SET) < 0) {
-        perror("Error seeking in FAT");
-        return 0xFFFFFFFF;  
-    }
+        //read the next cluster value
+        if (!readAt(fd, buffer, 4, position)) {
+            perror("Error reading FAT entry");
+            return 0xFFFFFFFF;
+        }
 
-    //read the next cluster value
-    if (read(fd, buffer, 4) != 4) {
-        perror("Error reading FAT entry");
-        return 0xFFFFFFFF;
+        //calculate next cluster from the entry
+        nextCluster = *(unsigned int*)buffer & 0x0FFFFFFF; 
     }
 
-    //calculate next cluster from the entry
-    unsigned int nextCluster = *(unsigned int*)buffer & 0x0FFFFFFF; 
-
     //end of cluster chain markers
     if (nextCluster >= 0x0FFFFFF8) {
         return 0xFFFFFFFF; 
@@ -778,6 +4554,35 @@ unsigned int getNextCluster(int fd, unsigned int currentCluster, BootSectorInfo*
     return nextCluster;
 }
 
+//find the index-th cluster of the chain starting at firstCluster
+//with the extent index it is a binary search over the chain's run offsets
+unsigned int getFileCluster(int fd, unsigned int firstCluster, unsigned int index, BootSectorInfo* bsi) {
+    ExtentChain* chain = (useExtentIndex && fatTable.pages && index > 0) ? findExtentChain(fd, firstCluster, bsi) : NULL;
+    if (chain) {
+        if (index >= chain->total) {
+            return 0xFFFFFFFF;
+        }
+        unsigned int low = 0;
+        unsigned int high = chain->count;
+        while (high - low > 1) {
+            unsigned int mid = low + (high - low) / 2;
+            if (chain->offsets[mid] <= index) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+        return chain->starts[low] + (index - chain->offsets[low]);
+    }
+
+    unsigned int cluster = firstCluster;
+    while (index > 0 && cluster != 0xFFFFFFFF) {
+        cluster = getNextCluster(fd, cluster, bsi);
+        index--;
+    }
+    return cluster;
+}
+
 //fucntion to handle writing to file NOT WORKING we tried :(
 void writeFile(int fd, const char* fileName, const char* data, BootSectorInfo* bsi) {
     int i;
@@ -797,41 +4602,38 @@ void writeFile(int fd, const char* fileName, const char* data, BootSectorInfo* b
             }
 
             //writing data to file starting at the current offset
-            unsigned int cluster = openFiles[i].cluster;
-            unsigned int sectorOffset = (openFiles[i].offset / bsi->bytesPerSector) % bsi->sectorsPerCluster;
-            unsigned int byteOffset = openFiles[i].offset % bsi->bytesPerSector;
+            unsigned int clusterSize = clusterBytes(bsi);
+            unsigned int clusterIndex = clusterIndexOf(openFiles[i].offset, bsi);
+            unsigned int cluster = getFileCluster(fd, openFiles[i].cluster, clusterIndex, bsi);
+            unsigned int byteOffset = offsetInCluster(openFiles[i].offset, bsi);
             unsigned int bytesWritten = 0;
 
             while (bytesWritten < dataSize) {
-                unsigned long long sector = ((cluster - 2) * bsi->sectorsPerCluster) + bsi->rootCluster + sectorOffset;
-                off_t sectorStart = sector * bsi->bytesPerSector;
+                if (cluster < 2 || cluster == 0xFFFFFFFF) {
+                    printf("Error: Failed to find next cluster.\n");
+                    return;
+                }
 
-                if (lseek(fd, sectorStart + byteOffset, SEEK_SET) < 0) {
-                    perror("Error seeking in file for writing");
+                unsigned char* clusterData = borrowClusterForWrite(fd, cluster, bsi);
+                if (!clusterData) {
                     return;
                 }
 
-                unsigned int bytesToWrite = bsi->bytesPerSector - byteOffset;
+                unsigned int bytesToWrite = clusterSize - byteOffset;
                 if (bytesWritten + bytesToWrite > dataSize) {
                     bytesToWrite = dataSize - bytesWritten;
                 }
-
-                if (write(fd, data + bytesWritten, bytesToWrite) < 0) {
+                memcpy(clusterData + byteOffset, data + bytesWritten, bytesToWrite);
+                if (!releaseDirtyCluster(fd, cluster, clusterData, bsi)) {
                     perror("Error writing to file");
                     return;
                 }
 
-                //reset byte offset for the next sector
+                //reset byte offset for the next cluster
                 bytesWritten += bytesToWrite;
                 byteOffset = 0; 
-                sectorOffset++;
-                if (sectorOffset >= bsi->sectorsPerCluster) {
-                    sectorOffset = 0;
+                if (bytesWritten < dataSize) {
                     cluster = getNextCluster(fd, cluster, bsi);
-                    if (cluster == 0xFFFFFFFF) {
-                        printf("Error: Failed to find next cluster.\n");
-                        return;
-                    }
                 }
             }
 
@@ -846,14 +4648,543 @@ void writeFile(int fd, const char* fileName, const char* data, BootSectorInfo* b
     }
 }
 
+#define MAX_BUDGET_CLIENTS 8
+#define BUDGET_MIN_SAMPLES 64
+
+//a cache that gives its memory to the global budget. usage, maxUseful and the
+//counters are read through callbacks, resize evicts down to (or allows up to)
+//the given number of bytes
+typedef struct {
+    const char* name;
+    unsigned long long (*usage)(void);
+    unsigned long long (*maxUseful)(BootSectorInfo* bsi);
+    bool (*resize)(int fd, unsigned long long limit, BootSectorInfo* bsi);
+    unsigned long long (*hits)(void);
+    unsigned long long (*misses)(void);
+    unsigned long long limit;
+    unsigned long long lastHits;
+    unsigned long long lastMisses;
+    double value;                  //smoothed recent hit rate
+} BudgetClient;
+
+BudgetClient budgetClients[MAX_BUDGET_CLIENTS];
+int numBudgetClients = 0;
+
+void registerBudgetClient(BudgetClient client) {
+    if (numBudgetClients < MAX_BUDGET_CLIENTS) {
+        budgetClients[numBudgetClients++] = client;
+    }
+}
+
+unsigned long long fatCacheUsage() {
+    if (fatTable.contiguous) {
+        return (unsigned long long)fatTable.numPages * fatTable.entriesPerPage * 4;
+    }
+    return (unsigned long long)fatTable.loadedPages * fatTable.entriesPerPage * 4;
+}
+
+unsigned long long fatCacheMaxUseful(BootSectorInfo* bsi) {
+    return (unsigned long long)fatTable.numPages * FAT_PAGE_SECTORS * bsi->bytesPerSector;
+}
+
+unsigned long long fatCacheHits() {
+    return fatTable.hits;
+}
+
+unsigned long long fatCacheMisses() {
+    return fatTable.misses;
+}
+
+unsigned long long clusterCacheUsage() {
+    return (unsigned long long)clusterCache.active * clusterCache.clusterSize;
+}
+
+unsigned long long clusterCacheMaxUseful(BootSectorInfo* bsi) {
+    (void)bsi;
+    return (unsigned long long)clusterCache.capacity * clusterCache.clusterSize;
+}
+
+bool clusterCacheResize(int fd, unsigned long long limit, BootSectorInfo* bsi) {
+    return resizeClusterCache(fd, limit / clusterCache.clusterSize, bsi);
+}
+
+unsigned long long clusterCacheHits() {
+    return clusterCache.hits;
+}
+
+unsigned long long clusterCacheMisses() {
+    return clusterCache.misses;
+}
+
+unsigned long long dirIndexUsage() {
+    return dirIndexTable.bytes;
+}
+
+unsigned long long dirIndexMaxUseful(BootSectorInfo* bsi) {
+    (void)bsi;
+    return DEFAULT_DIR_INDEX_BYTES;
+}
+
+bool dirIndexResize(int fd, unsigned long long limit, BootSectorInfo* bsi) {
+    (void)fd;
+    (void)bsi;
+    dirIndexTable.limit = limit;
+    trimDirIndexes(limit, NULL);
+    return true;
+}
+
+unsigned long long dirIndexHits() {
+    return dirIndexTable.hits;
+}
+
+unsigned long long dirIndexMisses() {
+    return dirIndexTable.builds;
+}
+
+//shrink clients, least valuable first, until the limits add up to the budget
+void enforceBudget(int fd, BootSectorInfo* bsi) {
+    unsigned long long total = 0;
+    for (int i = 0; i < numBudgetClients; i++) {
+        total += budgetClients[i].limit;
+    }
+
+    while (total > memoryBudget) {
+        BudgetClient* victim = NULL;
+        for (int i = 0; i < numBudgetClients; i++) {
+            BudgetClient* client = &budgetClients[i];
+            if (client->limit > 0 && (!victim || client->value < victim->value)) {
+                victim = client;
+            }
+        }
+        if (!victim) break;
+
+        unsigned long long cut = total - memoryBudget;
+        if (cut > victim->limit) cut = victim->limit;
+        victim->limit -= cut;
+        total -= cut;
+        victim->resize(fd, victim->limit, bsi);
+    }
+}
+
+//split the budget evenly, handing whatever a cache can't use to the others
+void applyBudget(int fd, BootSectorInfo* bsi) {
+    if (!memoryBudget || numBudgetClients == 0) {
+        return;
+    }
+
+    unsigned long long remaining = memoryBudget;
+    bool assigned[MAX_BUDGET_CLIENTS] = { false };
+    int left = numBudgetClients;
+    bool changed = true;
+    while (left > 0 && changed) {
+        changed = false;
+        unsigned long long share = remaining / left;
+        for (int i = 0; i < numBudgetClients; i++) {
+            unsigned long long most = budgetClients[i].maxUseful(bsi);
+            if (!assigned[i] && most <= share) {
+                budgetClients[i].limit = most;
+                assigned[i] = true;
+                remaining -= most;
+                left--;
+                changed = true;
+            }
+        }
+    }
+    for (int i = 0; i < numBudgetClients; i++) {
+        if (!assigned[i]) {
+            budgetClients[i].limit = remaining / left;
+        }
+    }
+
+    for (int i = 0; i < numBudgetClients; i++) {
+        budgetClients[i].resize(fd, budgetClients[i].limit, bsi);
+    }
+    enforceBudget(fd, bsi);
+}
+
+//called after every command. refresh each cache's hit rate, then move a slice
+//of memory from the least valuable cache to the most valuable one that is full
+//and still missing
+void rebalanceBudget(int fd, BootSectorInfo* bsi) {
+    if (!memoryBudget || numBudgetClients < 2) {
+        return;
+    }
+
+    bool wantsMore[MAX_BUDGET_CLIENTS] = { false };
+    for (int i = 0; i < numBudgetClients; i++) {
+        BudgetClient* client = &budgetClients[i];
+        unsigned long long hits = client->hits() - client->lastHits;
+        unsigned long long misses = client->misses() - client->lastMisses;
+        if (hits + misses < BUDGET_MIN_SAMPLES) continue;
+
+        client->value = 0.5 * client->value + 0.5 * ((double)hits / (hits + misses));
+        client->lastHits = client->hits();
+        client->lastMisses = client->misses();
+        wantsMore[i] = misses > 0 && client->usage() * 10 >= client->limit * 9 &&
+                       client->limit < client->maxUseful(bsi);
+    }
+
+    BudgetClient* receiver = NULL;
+    BudgetClient* donor = NULL;
+    for (int i = 0; i < numBudgetClients; i++) {
+        BudgetClient* client = &budgetClients[i];
+        if (wantsMore[i] && (!receiver || client->value > receiver->value)) {
+            receiver = client;
+        }
+    }
+    if (!receiver) {
+        return;
+    }
+    for (int i = 0; i < numBudgetClients; i++) {
+        BudgetClient* client = &budgetClients[i];
+        if (client != receiver && client->limit > 0 && (!donor || client->value < donor->value)) {
+            donor = client;
+        }
+    }
+    if (!donor || receiver->value <= donor->value + 0.05) {
+        return;
+    }
+
+    unsigned long long step = memoryBudget / 16;
+    if (step > donor->limit) step = donor->limit;
+    donor->limit -= step;
+    donor->resize(fd, donor->limit, bsi);
+    receiver->limit += step;
+    receiver->resize(fd, receiver->limit, bsi);
+}
+
+//register the caches that exist for this mount and give them their share
+void initBudget(int fd, BootSectorInfo* bsi) {
+    if (fatTable.pages) {
+        registerBudgetClient((BudgetClient){ "FAT cache", fatCacheUsage, fatCacheMaxUseful, resizeFatCache,
+                                             fatCacheHits, fatCacheMisses, 0, 0, 0, 0.0 });
+    }
+    if (clusterCache.capacity) {
+        registerBudgetClient((BudgetClient){ "Cluster cache", clusterCacheUsage, clusterCacheMaxUseful,
+                                             clusterCacheResize, clusterCacheHits, clusterCacheMisses, 0, 0, 0, 0.0 });
+    }
+    registerBudgetClient((BudgetClient){ "Dir index", dirIndexUsage, dirIndexMaxUseful, dirIndexResize,
+                                         dirIndexHits, dirIndexMisses, 0, 0, 0, 0.0 });
+    applyBudget(fd, bsi);
+}
+
+//handle the budget command: show usage, or set a new total and redistribute
+void budgetCommand(int fd, const char* argument, BootSectorInfo* bsi) {
+    if (argument && *argument) {
+        unsigned long long budget = strtoull(argument, NULL, 10) * 1024 * 1024;
+        if (!budget) {
+            printf("Error: Budget must be at least 1 MB.\n");
+            return;
+        }
+        memoryBudget = budget;
+        applyBudget(fd, bsi);
+    }
+
+    if (!memoryBudget) {
+        printf("No memory budget set\n");
+    } else {
+        printf("Memory budget (in bytes): %llu\n", memoryBudget);
+    }
+    for (int i = 0; i < numBudgetClients; i++) {
+        BudgetClient* client = &budgetClients[i];
+        if (memoryBudget) {
+            printf("%s: %llu used, %llu limit, hit rate %.1f%%\n", client->name, client->usage(), client->limit,
+                   100.0 * client->value);
+        } else {
+            printf("%s: %llu used\n", client->name, client->usage());
+        }
+    }
+}
+
+//write every pending change to the image: dirty clusters, then dirty FAT sectors,
+//then the dirty regions of a mapped or RAM image
+bool syncImage(int fd, BootSectorInfo* bsi) {
+    bool ok = flushClusterCache(fd, bsi);
+    ok = flushFatTable(fd, bsi) && ok;
+    ok = flushImageMap(fd) && ok;
+    return ok;
+}
+
+#define DEFAULT_DIRTY_HIGH 40             //percent of the cluster cache
+#define DEFAULT_DIRTY_LOW 10
+#define DEFAULT_FLUSH_AGE 5               //seconds
+
+//background writer for dirty clusters and FAT sectors. the prompt holds lock
+//while a command runs, so the caches never need finer locking, and the thread
+//does its writes while the prompt waits for input. it wakes every second, or
+//early when a command leaves the cache above the high watermark
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool stop;
+    bool kicked;                   //set with wake so a signal sent early isn't lost
+    int fd;
+    BootSectorInfo* bsi;
+    unsigned int highPercent;
+    unsigned int lowPercent;
+    unsigned int maxAge;
+    unsigned long long passes;
+    unsigned long long written;
+} Flusher;
+
+Flusher flusher = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                    .highPercent = DEFAULT_DIRTY_HIGH, .lowPercent = DEFAULT_DIRTY_LOW,
+                    .maxAge = DEFAULT_FLUSH_AGE };
+bool useFlusher = true;
+
+unsigned int countDirtySlots() {
+    unsigned int dirty = 0;
+    for (unsigned int i = 0; i < clusterCache.capacity; i++) {
+        if (clusterCache.slots[i].valid && clusterCache.slots[i].dirty) dirty++;
+    }
+    return dirty;
+}
+
+bool aboveDirtyWatermark(unsigned int dirty, unsigned int percent) {
+    return clusterCache.active && (unsigned long long)dirty * 100 > (unsigned long long)clusterCache.active * percent;
+}
+
+//write back one slot for the flusher, counting it
+bool flushSlot(CacheSlot* slot) {
+    if (!slot->valid || !slot->dirty || slot->pins > 0) {
+        return false;
+    }
+    if (!writeBackSlot(flusher.fd, slot, flusher.bsi)) {
+        return false;
+    }
+    flusher.written++;
+    return true;
+}
+
+//one pass, called with the lock held. over the high watermark the least recently
+//used dirty slots go first until the low watermark, then anything past the age
+//limit. the FAT is written with the clusters it points at
+void flushDirtyData() {
+    time_t now = monotonicSeconds();
+    unsigned int dirty = countDirtySlots();
+    bool pressure = aboveDirtyWatermark(dirty, flusher.highPercent);
+
+    if (pressure) {
+        SlotList* lists[2] = { &clusterCache.probation, &clusterCache.protectedList };
+        for (int l = 0; l < 2 && aboveDirtyWatermark(dirty, flusher.lowPercent); l++) {
+            for (CacheSlot* slot = lists[l]->tail; slot && aboveDirtyWatermark(dirty, flusher.lowPercent);
+                 slot = slot->prev) {
+                if (flushSlot(slot)) dirty--;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < clusterCache.capacity; i++) {
+        CacheSlot* slot = &clusterCache.slots[i];
+        if (slot->valid && slot->dirty && now - slot->dirtySince >= (time_t)flusher.maxAge) {
+            flushSlot(slot);
+        }
+    }
+
+    if (fatTable.dirtyCount && (pressure || now - fatTable.dirtySince >= (time_t)flusher.maxAge)) {
+        flushFatTable(flusher.fd, flusher.bsi);
+    }
+    flusher.passes++;
+}
+
+void* flusherMain(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&flusher.lock);
+    while (!flusher.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        while (!flusher.kicked && !flusher.stop) {
+            if (pthread_cond_timedwait(&flusher.wake, &flusher.lock, &deadline) == ETIMEDOUT) break;
+        }
+        flusher.kicked = false;
+        if (!flusher.stop && dirPrefetch.count) {
+            prefetchClusters(flusher.fd, dirPrefetch.clusters, dirPrefetch.count, flusher.bsi);
+            dirPrefetch.count = 0;
+        }
+        if (!flusher.stop) {
+            flushDirtyData();
+        }
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+//start the thread when there are caches holding dirty data. --ram keeps its
+//write-on-sync behaviour, so it gets no flusher
+bool startFlusher(int fd, BootSectorInfo* bsi) {
+    if (imageInRam || (!clusterCache.capacity && !fatTable.pages)) {
+        return true;
+    }
+    flusher.fd = fd;
+    flusher.bsi = bsi;
+    flusher.stop = false;
+    if (pthread_create(&flusher.thread, NULL, flusherMain, NULL) != 0) {
+        return false;
+    }
+    flusher.running = true;
+    return true;
+}
+
+//stop the thread, the caller drains whatever is still dirty
+void stopFlusher() {
+    if (!flusher.running) {
+        return;
+    }
+    pthread_mutex_lock(&flusher.lock);
+    flusher.stop = true;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&flusher.lock);
+    pthread_join(flusher.thread, NULL);
+    flusher.running = false;
+}
+
+//another process wrote the image since this one last looked. clean clusters and
+//FAT pages are dropped so they are read again, from the segment where possible
+void refreshSharedCache(int fd, BootSectorInfo* bsi) {
+    if (!sharedCache.header || sharedGeneration() == sharedCache.seenGeneration) {
+        return;
+    }
+    sharedCache.seenGeneration = sharedGeneration();
+
+    for (unsigned int i = 0; i < clusterCache.capacity; i++) {
+        CacheSlot* slot = &clusterCache.slots[i];
+        if (slot->valid && !slot->dirty && slot->pins == 0) {
+            hashRemove(slot);
+            slot->valid = false;
+        }
+    }
+
+    invalidateExtentIndex();
+    dropAllDirIndexes();
+    dropAllDirFilters();
+    clearDentryCache();
+    if (!fatTable.pages || fatTable.dirtyCount) {
+        return;
+    }
+    if (fatTable.contiguous) {
+        size_t fatBytes = sectorToOffset(bsi->sectorsPerFAT, bsi);
+        if (!sharedReadFat(fatTable.contiguous, fatBytes, 0)) {
+            //the segment's copy was given up, publish the one from the image again
+            uint64_t generation = sharedGeneration();
+            if (readAt(fd, fatTable.contiguous, fatBytes, fatOffsetInImage(bsi))) {
+                sharedStoreFat(fatTable.contiguous, fatBytes, generation);
+            }
+        }
+        return;
+    }
+    for (unsigned int page = 0; page < fatTable.numPages; page++) {
+        if (BIT_TEST(fatTable.loaded, page)) {
+            free(fatTable.pages[page]);
+            fatTable.pages[page] = NULL;
+            BIT_CLEAR(fatTable.loaded, page);
+            BIT_CLEAR(fatTable.referenced, page);
+            fatTable.loadedPages--;
+        }
+    }
+}
+
+//take the caches for a command
+void beginCommand() {
+    if (flusher.running) {
+        pthread_mutex_lock(&flusher.lock);
+    }
+}
+
+//hand the caches back, waking the flusher if the command left too much dirty or
+//queued directories to prefetch. without the thread the directories only get
+//a kernel read-ahead hint
+void endCommand(int fd, BootSectorInfo* bsi) {
+    if (!flusher.running || !clusterCache.capacity) {
+        adviseClusters(fd, dirPrefetch.clusters, dirPrefetch.count, bsi);
+        dirPrefetch.count = 0;
+    }
+    if (!flusher.running) {
+        return;
+    }
+    if (dirPrefetch.count || aboveDirtyWatermark(countDirtySlots(), flusher.highPercent)) {
+        flusher.kicked = true;
+        pthread_cond_signal(&flusher.wake);
+    }
+    pthread_mutex_unlock(&flusher.lock);
+}
+
+void printFlusherStats() {
+    if (!flusher.running) {
+        printf("Background flusher not running\n");
+        return;
+    }
+    printf("Dirty clusters: %u of %u (high %u%%, low %u%%)\n", countDirtySlots(), clusterCache.active,
+           flusher.highPercent, flusher.lowPercent);
+    printf("Dirty FAT sectors: %u\n", fatTable.dirtyCount);
+    printf("Age limit (in seconds): %u\n", flusher.maxAge);
+    printf("Flusher passes: %llu, clusters written: %llu\n", flusher.passes, flusher.written);
+}
+
 //main
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: ./filesys [FAT32 ISO]\n");
+    const char* imagePath = NULL;
+    bool useMmap = false;
+    bool useRam = false;
+    const char* overlayPath = NULL;
+    bool useDirect = false;
+    bool useUring = false;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--fat-cache=", 12) == 0) {
+            fatCacheLimit = strtoull(argv[i] + 12, NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--fat-index=extent") == 0) {
+            useExtentIndex = true;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            useMmap = true;
+        } else if (strcmp(argv[i], "--ram") == 0) {
+            useRam = true;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            useDirect = true;
+        } else if (strncmp(argv[i], "--overlay=", 10) == 0) {
+            overlayPath = argv[i] + 10;
+        } else if (strcmp(argv[i], "--io=uring") == 0) {
+            useUring = true;
+        } else if (strncmp(argv[i], "--queue-depth=", 14) == 0) {
+            ioQueueDepth = strtoul(argv[i] + 14, NULL, 10);
+        } else if (strncmp(argv[i], "--mem-budget=", 13) == 0) {
+            memoryBudget = strtoull(argv[i] + 13, NULL, 10) * 1024 * 1024;
+        } else if (strncmp(argv[i], "--dirty-ratio=", 14) == 0) {
+            if (sscanf(argv[i] + 14, "%u,%u", &flusher.highPercent, &flusher.lowPercent) != 2 ||
+                flusher.lowPercent > flusher.highPercent || flusher.highPercent > 100) {
+                imagePath = NULL;
+                break;
+            }
+        } else if (strncmp(argv[i], "--flush-age=", 12) == 0) {
+            flusher.maxAge = strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "--dir-prefetch=", 15) == 0) {
+            dirPrefetch.limit = strtoul(argv[i] + 15, NULL, 10);
+        } else if (strcmp(argv[i], "--shared-cache") == 0) {
+            sharedSlots = DEFAULT_SHARED_SLOTS;
+        } else if (strncmp(argv[i], "--shared-cache=", 15) == 0) {
+            sharedSlots = strtoul(argv[i] + 15, NULL, 10);
+        } else if (strncmp(argv[i], "--compact-ratio=", 16) == 0) {
+            compactRatio = strtoul(argv[i] + 16, NULL, 10);
+        } else if (strcmp(argv[i], "--no-flusher") == 0) {
+            useFlusher = false;
+        } else if (strncmp(argv[i], "--cluster-cache=", 16) == 0) {
+            clusterCacheSlots = strtoul(argv[i] + 16, NULL, 10);
+        } else if (argv[i][0] != '-' && imagePath == NULL) {
+            imagePath = argv[i];
+        } else {
+            imagePath = NULL;
+            break;
+        }
+    }
+
+    if (imagePath == NULL) {
+        printf("Usage: ./filesys [--fat-cache=MB] [--fat-index=extent] [--mmap] [--ram] [--overlay=FILE] [--direct] [--cluster-cache=SLOTS] [--io=uring] [--queue-depth=N] [--mem-budget=MB] [--dirty-ratio=HIGH,LOW] [--flush-age=SECONDS] [--no-flusher] [--dir-prefetch=N] [--shared-cache[=SLOTS]] [--compact-ratio=PERCENT] [FAT32 ISO]\n");
         return 1;
     }
 
-    int fd = open(argv[1], O_RDWR);
+    //with an overlay the base image is never written
+    int fd = open(imagePath, overlayPath ? O_RDONLY : O_RDWR);
     if (fd == -1) {
         perror("Error opening file");
         return 1;
@@ -861,28 +5192,102 @@ int main(int argc, char *argv[]) {
 
     //read the boot sector to initialize the BootSectorInfo
     unsigned char bootSector[512];
-    if (read(fd, bootSector, sizeof(bootSector)) != sizeof(bootSector)) {
+    if (!readAt(fd, bootSector, sizeof(bootSector), 0)) {
         perror("Failed to read boot sector");
         close(fd);
         return 1;
     }
 
-    //initialize the boot sector info
-    BootSectorInfo bsi = {
-        .bytesPerSector = *(unsigned short *)(bootSector + 11),
-        .sectorsPerCluster = *(bootSector + 13),
-        .rootCluster = *(unsigned int *)(bootSector + 44),
-        .sectorsPerFAT = *(unsigned int *)(bootSector + 36),
-        .sizeOfImage = lseek(fd, 0, SEEK_END) 
-    };
-    bsi.totalClusters = (bsi.sizeOfImage / (bsi.sectorsPerCluster * bsi.bytesPerSector));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to get image file size");
+        close(fd);
+        return 1;
+    }
+
+    //initialize the boot sector info and the geometry derived from it
+    BootSectorInfo bsi;
+    if (!parseBootSector(bootSector, st.st_size, &bsi)) {
+        close(fd);
+        return 1;
+    }
+
+    //send every write to the sidecar, the mapping modes need a writable image
+    if (overlayPath) {
+        if (!initOverlay(overlayPath, &bsi)) {
+            close(fd);
+            return 1;
+        }
+        if (useRam || useMmap) {
+            printf("Warning: --ram and --mmap are ignored with --overlay\n");
+            useRam = useMmap = false;
+        }
+    }
+
+    //keep the whole image in memory and write changes back on sync/exit
+    if (useRam && !loadImageIntoRam(fd, &bsi)) {
+        printf("Warning: image not loaded into RAM, using read/write\n");
+    }
+
+    //map the image so directory scans can read clusters in place
+    if (useMmap && !imageMap && !mapImage(fd, &bsi)) {
+        printf("Warning: mmap unavailable, using read/write\n");
+    }
+
+    //a global budget overrides the FAT cap, the FAT starts with at most half of it
+    mapPageSize = sysconf(_SC_PAGESIZE);
+    if (memoryBudget) {
+        fatCacheLimit = memoryBudget / 2;
+    }
+
+    //processes on the same image share the FAT and clean clusters. the private
+    //image modes can't, their view of the image differs from the file
+    if (sharedSlots && (overlayPath || imageMap)) {
+        printf("Warning: --shared-cache is ignored with --overlay, --ram and --mmap\n");
+    } else if (sharedSlots && !initSharedCache(imagePath, &st, &bsi)) {
+        printf("Warning: shared cache unavailable\n");
+    }
+
+    //set up the FAT cache so cluster chain walks are served from memory
+    //if it can't be set up, getNextCluster falls back to reading entries from the image
+    if (!loadFatTable(fd, &bsi)) {
+        printf("Warning: FAT not cached, reading entries from the image\n");
+    }
+
+    //batched cluster reads go through io_uring when asked for and available
+    if (useUring && (ioQueueDepth == 0 || !initIoRing(ioQueueDepth))) {
+        printf("Warning: io_uring unavailable, using synchronous reads\n");
+    }
+
+    //clusters are cached and written back lazily unless the image is mapped
+    if (!initClusterCache(&bsi)) {
+        printf("Warning: cluster cache disabled\n");
+    }
+
+    //caches share the global memory budget
+    initBudget(fd, &bsi);
 
-    //reset the file descriptor position for further operations
-    lseek(fd, 0, SEEK_SET); 
+    //large reads stream around the host page cache
+    if (useDirect && !initDirectIo(imagePath, &bsi)) {
+        printf("Warning: direct I/O unavailable, using buffered reads\n");
+    }
+
+    //directory scans use AVX2 when the CPU has it
+    initDirScan();
+
+    //subdirectories seen by ls and cd are loaded ahead of the next cd
+    if (!initDirPrefetch()) {
+        printf("Warning: directory prefetch disabled\n");
+    }
+
+    //dirty data is written in the background between commands
+    if (useFlusher && !startFlusher(fd, &bsi)) {
+        printf("Warning: background flusher unavailable, writing at eviction and exit\n");
+    }
 
     //initialize the directory context
-    DirectoryContext context = {2, "/", ""}; 
-    strncpy(context.imageName, argv[1], sizeof(context.imageName) - 1); 
+    DirectoryContext context = { .currentCluster = bsi.rootCluster, .path = "/" }; 
+    strncpy(context.imageName, imagePath, sizeof(context.imageName) - 1); 
     context.imageName[sizeof(context.imageName) - 1] = '\0'; 
 
     char command[256];
@@ -893,16 +5298,41 @@ int main(int argc, char *argv[]) {
             break; 
         }
         command[strcspn(command, "\n")] = 0; 
+        beginCommand();
+        refreshSharedCache(fd, &bsi);
 
         //if statement to handle the different required commands for the system
         if (strcmp(command, "exit") == 0) {
+            endCommand(fd, &bsi);
             break;
         } else if (strcmp(command, "info") == 0) {
-            printBootSectorInfo(argv[1]);
+            printBootSectorInfo(imagePath);
+        } else if (strcmp(command, "sync") == 0) {
+            if (syncImage(fd, &bsi)) {
+                printf("Image synced\n");
+            }
+        } else if (strcmp(command, "commit") == 0) {
+            if (syncImage(fd, &bsi)) {
+                commitOverlay(imagePath);
+            }
+        } else if (strcmp(command, "budget") == 0 || strncmp(command, "budget ", 7) == 0) {
+            budgetCommand(fd, command + 6, &bsi);
+        } else if (strcmp(command, "cachestats") == 0) {
+            printCacheStats();
+            printDirIndexStats();
+        } else if (strcmp(command, "dirstats") == 0) {
+            printDirFilterStats();
+            printDentryStats();
+        } else if (strcmp(command, "flushstats") == 0) {
+            printFlusherStats();
+        } else if (strcmp(command, "extents") == 0) {
+            printExtentStats(fd, &bsi);
         } else if (strncmp(command, "cd ", 3) == 0) {
             char dirName[256];
-            sscanf(command + 3, "%s", dirName); 
+            sscanf(command + 3, "%255s", dirName); 
             changeDirectory(fd, dirName, &context, &bsi);
+        } else if (strcmp(command, "compact") == 0) {
+            compactDirectory(fd, context.currentCluster, &bsi);
         } else if (strcmp(command, "ls") == 0) {
             listDirectory(fd, &context, &bsi);
         } else if (strncmp(command, "mkdir ", 6) == 0) {
@@ -958,8 +5388,24 @@ int main(int argc, char *argv[]) {
 	} else {
             printf("Unknown command\n");
         }
+        rebalanceBudget(fd, &bsi);
+        endCommand(fd, &bsi);
     }
 
+    //exit drains everything the flusher hasn't written yet
+    stopFlusher();
+    freeDirPrefetch();
+    syncImage(fd, &bsi);
+    freeClusterCache();
+    freeExtentIndex();
+    dropAllDirIndexes();
+    dropAllDirFilters();
+    freeFatTable();
+    unmapImage();
+    freeIoRing();
+    freeOverlay();
+    freeDirectIo();
+    freeSharedCache();
     close(fd);
     return 0;
 }
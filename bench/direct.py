@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#compare a large 'read' with and without --direct.
+#
+#  direct.py [--filesys ./filesys] [--size 256M] [--runs 5] [--dir /tmp]
+#
+#builds an image holding one file of --size bytes and reads the whole file with
+#a single 'read' command. cold runs drop the image from the host page cache first
+#(posix_fadvise DONTNEED, no root needed), warm runs read it in first. each run
+#reports the wall time of the whole filesys process and how much of the image is
+#left in the page cache afterwards (mincore). the median run is printed
+import argparse
+import ctypes
+import ctypes.util
+import mmap
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+import mkimage  # noqa: E402
+
+libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+libc.mmap.restype = ctypes.c_void_p
+libc.mmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_long]
+libc.munmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+libc.mincore.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_char_p]
+
+
+#bytes of a file that are in the page cache
+def residentBytes(path):
+    size = os.path.getsize(path)
+    page = mmap.PAGESIZE
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        address = libc.mmap(None, size, mmap.PROT_READ, mmap.MAP_SHARED, fd, 0)
+        if address in (None, ctypes.c_void_p(-1).value):
+            raise OSError(ctypes.get_errno(), 'mmap')
+        pages = (size + page - 1) // page
+        vector = ctypes.create_string_buffer(pages)
+        if libc.mincore(address, size, vector) != 0:
+            raise OSError(ctypes.get_errno(), 'mincore')
+        libc.munmap(address, size)
+        return sum(b & 1 for b in vector.raw) * page
+    finally:
+        os.close(fd)
+
+
+def dropFromPageCache(path):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+
+def loadIntoPageCache(path):
+    with open(path, 'rb') as image:
+        while image.read(8 << 20):
+            pass
+
+
+def run(filesys, image, size, options, cold):
+    if cold:
+        dropFromPageCache(image)
+    else:
+        loadIntoPageCache(image)
+    commands = 'open BIGFILE -r\nread BIGFILE %d\nexit\n' % size
+    start = time.perf_counter()
+    subprocess.run([filesys] + options + ['--no-flusher', image], input=commands.encode(),
+                   stdout=subprocess.DEVNULL, check=True)
+    return time.perf_counter() - start, residentBytes(image)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='--direct against buffered reads')
+    parser.add_argument('--filesys', default=os.path.join(HERE, '..', 'filesys'))
+    parser.add_argument('--size', default='256M')
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--dir', default=tempfile.gettempdir())
+    args = parser.parse_args()
+
+    size = mkimage.parseSize(args.size)
+    image = os.path.join(args.dir, 'direct-bench.img')
+    built = mkimage.Image(image, size + (64 << 20), 512, 4096)
+    built.finish([built.addFile('BIGFILE', size, None)])
+
+    print('reading %d MB, median of %d runs' % (size >> 20, args.runs))
+    print('%-10s %-5s %10s %10s %16s' % ('mode', 'cache', 'seconds', 'MB/s', 'page cache MB'))
+    try:
+        for cold in (True, False):
+            for name, options in (('buffered', []), ('direct', ['--direct'])):
+                results = [run(args.filesys, image, size, options, cold) for _ in range(args.runs)]
+                seconds = statistics.median(r[0] for r in results)
+                resident = statistics.median(r[1] for r in results)
+                print('%-10s %-5s %10.3f %10.0f %16.1f' % (name, 'cold' if cold else 'warm', seconds,
+                                                          size / seconds / (1 << 20), resident / (1 << 20)))
+    finally:
+        os.unlink(image)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,185 @@
+//time name lookups in one large directory with each entry scanner.
+//
+//  dirscan IMAGE DIRECTORY [LOOKUPS]
+//
+//the directory's whole chain is read into memory once, then the same lookups
+//run against it with the old per-entry loop (formatEntryName and strcmp), and
+//with dirScan using the scalar, SSE2 and AVX2 kernels. half the lookups are
+//names that exist, at random positions, and half are missing names, which scan
+//the whole directory. every scanner has to agree with the old loop
+#define main fat_main
+#include "../FAT.c"
+#undef main
+
+#define DEFAULT_LOOKUPS 2000
+
+typedef struct {
+    const char* name;
+    uint32_t (*headMask)(const unsigned char*, uint8_t, uint8_t);
+    bool (*keyMatches)(const unsigned char*, const DirKey*);
+} Scanner;
+
+double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//average time of the hits (even lookups) and misses (odd ones), and per entry passed
+void printResult(const char* name, const double elapsed[2], unsigned int lookups, unsigned long long scanned) {
+    printf("%-8s %14.0f %14.0f %12.2f\n", name, elapsed[0] / ((lookups + 1) / 2) * 1e9,
+           elapsed[1] / (lookups / 2) * 1e9, (elapsed[0] + elapsed[1]) / scanned * 1e9);
+}
+
+//the lookup loop dirScan replaced
+unsigned int strcmpLookup(const unsigned char* data, unsigned int count, const char* name) {
+    for (unsigned int i = 0; i < count; i++) {
+        const DirEntry* entry = (const DirEntry*)(data + (size_t)i * DIR_ENTRY_SIZE);
+        if ((unsigned char)entry->name[0] == 0x00) return i;
+        if ((unsigned char)entry->name[0] == 0xE5 || entry->attr == 0x0F) continue;
+        char formattedName[12];
+        formatEntryName(entry, formattedName);
+        if (strcmp(formattedName, name) == 0) return i;
+    }
+    return count;
+}
+
+//read the chain of a directory in the root into one buffer
+unsigned char* loadDirectory(int fd, const char* name, unsigned int* count, BootSectorInfo* bsi) {
+    size_t clusterSize = clusterBytes(bsi);
+    unsigned char* root = malloc(clusterSize);
+    if (!root || !readAt(fd, root, clusterSize, clusterOffset(bsi->rootCluster, bsi))) {
+        free(root);
+        return NULL;
+    }
+    uint32_t first = 0;
+    for (unsigned int i = 0; i < entriesPerCluster(bsi); i++) {
+        char formattedName[12];
+        formatEntryName((const DirEntry*)(root + i * DIR_ENTRY_SIZE), formattedName);
+        if (strcmp(formattedName, name) == 0) {
+            first = dirEntryCluster((const DirEntry*)(root + i * DIR_ENTRY_SIZE));
+            break;
+        }
+    }
+    free(root);
+    if (first < 2) {
+        printf("Error: No directory %s in the root\n", name);
+        return NULL;
+    }
+
+    unsigned char* data = NULL;
+    unsigned int clusters = 0;
+    for (uint32_t c = first; c >= 2 && c < 0x0FFFFFF8 && clusters < bsi->totalClusters; c = getNextCluster(fd, c, bsi)) {
+        unsigned char* grown = realloc(data, (clusters + 1) * clusterSize);
+        if (!grown || !readAt(fd, grown + clusters * clusterSize, clusterSize, clusterOffset(c, bsi))) {
+            free(grown ? grown : data);
+            return NULL;
+        }
+        data = grown;
+        clusters++;
+    }
+    *count = clusters * entriesPerCluster(bsi);
+    return data;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("Usage: dirscan IMAGE DIRECTORY [LOOKUPS]\n");
+        return 1;
+    }
+    unsigned int lookups = argc > 3 ? (unsigned int)atoi(argv[3]) : DEFAULT_LOOKUPS;
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening image");
+        return 1;
+    }
+    struct stat imageStat;
+    unsigned char bootSector[512];
+    BootSectorInfo bsi;
+    if (fstat(fd, &imageStat) < 0 || !preadFull(fd, bootSector, sizeof(bootSector), 0) ||
+        !parseBootSector(bootSector, imageStat.st_size, &bsi) || !loadFatTable(fd, &bsi)) {
+        printf("Error: Can't read %s\n", argv[1]);
+        return 1;
+    }
+    unsigned int count;
+    unsigned char* data = loadDirectory(fd, argv[2], &count, &bsi);
+    if (!data) {
+        return 1;
+    }
+
+    //live names to look up, and as many names that aren't there
+    unsigned int live = 0;
+    for (unsigned int i = 0; i < count && data[(size_t)i * DIR_ENTRY_SIZE] != 0x00; i++) {
+        if (data[(size_t)i * DIR_ENTRY_SIZE] != 0xE5) live++;
+    }
+    char (*names)[12] = malloc((size_t)lookups * sizeof(*names));
+    unsigned int* expected = malloc(lookups * sizeof(unsigned int));
+    if (!names || !expected || live == 0) {
+        printf("Error: Nothing to look up\n");
+        return 1;
+    }
+    srand(1);
+    for (unsigned int k = 0; k < lookups; k++) {
+        if (k % 2) {
+            snprintf(names[k], sizeof(names[k]), "%c%07u", 'A' + k % 26, 9000000 + k);
+        } else {
+            unsigned int pick = rand() % live;
+            for (unsigned int i = 0; ; i++) {
+                const DirEntry* entry = (const DirEntry*)(data + (size_t)i * DIR_ENTRY_SIZE);
+                if ((unsigned char)entry->name[0] == 0xE5 || pick-- > 0) continue;
+                formatEntryName(entry, names[k]);
+                break;
+            }
+        }
+    }
+
+    Scanner scanners[4];
+    int numScanners = 0;
+    scanners[numScanners++] = (Scanner){ "scalar", headMaskScalar, keyMatchesScalar };
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+    scanners[numScanners++] = (Scanner){ "sse2", headMaskSse2, keyMatchesSse2 };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanners[numScanners++] = (Scanner){ "avx2", headMaskAvx2, keyMatchesSse2 };
+    }
+#endif
+
+    printf("%u entries (%u live), %u lookups, half of them missing\n", count, live, lookups);
+    printf("%-8s %14s %14s %12s\n", "scanner", "hit ns", "miss ns", "ns/entry");
+    unsigned long long scanned = 0;
+    double elapsed[2] = { 0, 0 };
+    for (unsigned int k = 0; k < lookups; k++) {
+        double start = seconds();
+        expected[k] = strcmpLookup(data, count, names[k]);
+        elapsed[k % 2] += seconds() - start;
+        scanned += expected[k] + (k % 2 ? 0 : 1);
+    }
+    printResult("strcmp", elapsed, lookups, scanned);
+
+    bool ok = true;
+    for (int s = 0; s < numScanners; s++) {
+        headMask = scanners[s].headMask;
+        keyMatches = scanners[s].keyMatches;
+        unsigned int mismatches = 0;
+        elapsed[0] = elapsed[1] = 0;
+        for (unsigned int k = 0; k < lookups; k++) {
+            DirKey key;
+            makeDirKey(names[k], &key);
+            double start = seconds();
+            unsigned int found = dirScan(data, 0, count, DIR_SCAN_MATCH, &key);
+            elapsed[k % 2] += seconds() - start;
+            if (found != expected[k]) mismatches++;
+        }
+        printResult(scanners[s].name, elapsed, lookups, scanned);
+        if (mismatches) {
+            printf("%s: %u lookups disagree with strcmp\n", scanners[s].name, mismatches);
+            ok = false;
+        }
+    }
+
+    free(names);
+    free(expected);
+    free(data);
+    close(fd);
+    return ok ? 0 : 1;
+}
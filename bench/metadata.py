@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+#metadata hit rate of the cluster cache while a large file is read.
+#
+#  metadata.py [--filesys ./filesys] [--size 64M] [--dirs 8] [--entries 2000]
+#              [--rounds 16] [--slots 256,1024] [--dir /tmp]
+#
+#builds an image holding --dirs directories of --entries files each and one file
+#of --size bytes. every round lists each directory ('cd', 'ls', 'cd ..'), then the
+#mixed workload also reads the next 1/--rounds of the file, so by the end the
+#whole file has gone through a cache far smaller than it. the directories only
+#workload is the same without the reads. 'cachestats' after the last round gives
+#the hit rates, printed for each cluster cache size in --slots
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+import mkimage  # noqa: E402
+
+
+def workload(dirs, rounds, size, mixed):
+    commands = ['open BIGFILE -r'] if mixed else []
+    chunk = (size + rounds - 1) // rounds
+    for _ in range(rounds):
+        for name in dirs:
+            commands += ['cd ' + name, 'ls', 'cd ..']
+        if mixed:
+            commands.append('read BIGFILE %d' % chunk)
+    return commands + ['cachestats', 'exit']
+
+
+def run(filesys, image, slots, commands):
+    result = subprocess.run([filesys, '--cluster-cache=%d' % slots, '--no-flusher', image],
+                            input=('\n'.join(commands) + '\n').encode(), stdout=subprocess.PIPE, check=True)
+    output = result.stdout.decode('latin-1')
+    metadata = re.search(r'Metadata hit rate: ([0-9.]+)% \((\d+) of (\d+)\)', output)
+    overall = re.search(r'^Hit rate: ([0-9.]+)%', output, re.M)
+    if not metadata or not overall:
+        sys.exit('metadata: no cachestats in the output, was filesys built with the cluster cache?')
+    return float(metadata.group(1)), int(metadata.group(3)), float(overall.group(1))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='metadata hit rate under a mixed workload')
+    parser.add_argument('--filesys', default=os.path.join(HERE, '..', 'filesys'))
+    parser.add_argument('--size', default='64M')
+    parser.add_argument('--dirs', type=int, default=8)
+    parser.add_argument('--entries', type=int, default=2000)
+    parser.add_argument('--rounds', type=int, default=16)
+    parser.add_argument('--slots', default='256,1024')
+    parser.add_argument('--dir', default=tempfile.gettempdir())
+    args = parser.parse_args()
+
+    size = mkimage.parseSize(args.size)
+    image = os.path.join(args.dir, 'metadata-bench.img')
+    built = mkimage.Image(image, size + (64 << 20), 512, 4096)
+    dirs = ['DIR%d' % i for i in range(args.dirs)]
+    root = [built.addDirectory(name, args.entries, None) for name in dirs]
+    built.finish(root + [built.addFile('BIGFILE', size, None)])
+    dirClusters = args.dirs * (((args.entries + 2) * 32 + 4095) // 4096)
+
+    print('%d directories in %d clusters, %d MB file read in %d pieces' %
+          (args.dirs, dirClusters, size >> 20, args.rounds))
+    print('%-8s %-12s %16s %12s %10s' % ('slots', 'workload', 'metadata hits', 'lookups', 'all hits'))
+    try:
+        for slots in (int(s) for s in args.slots.split(',')):
+            for name, mixed in (('directories', False), ('mixed', True)):
+                rate, lookups, overall = run(args.filesys, image, slots,
+                                             workload(dirs, args.rounds, size, mixed))
+                print('%-8d %-12s %15.1f%% %12d %9.1f%%' % (slots, name, rate, lookups, overall))
+    finally:
+        os.unlink(image)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+#build a sparse FAT32 image for the benchmarks and tests.
+#
+#  mkimage.py OUT --size 64M [--sector 512] [--cluster 4K]
+#             [--file NAME:BYTES[@OFFSET]] [--dir NAME:ENTRIES[@OFFSET]] [--deleted PERCENT]
+#
+#files and directories go in the root. @OFFSET places the first cluster at (or
+#just past) that byte offset of the image, everything else is laid out from the
+#start of the data region. each cluster of a file holds one line repeated:
+#"NAME cluster NNNNNNNNNN\n", so a reader can check it got the right cluster.
+#directories are filled with empty files named A0000000, B0000001, ... Z0000025,
+#A0000026, ..., and --deleted turns that share of them into deleted entries
+#only the clusters and FAT sectors that hold something are written
+import argparse
+import struct
+import sys
+
+UNITS = {'': 1, 'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30, 'T': 1 << 40}
+
+
+def parseSize(text):
+    text = text.strip().upper()
+    unit = text[-1] if text and text[-1] in UNITS else ''
+    return int(text[:len(text) - len(unit)]) * UNITS[unit]
+
+
+def parseItem(text):
+    name, _, rest = text.partition(':')
+    amount, _, offset = rest.partition('@')
+    if not name or len(name) > 11 or '.' in name:
+        sys.exit('mkimage: %s: names are up to 11 characters without a dot' % name)
+    return name.upper(), parseSize(amount), parseSize(offset) if offset else None
+
+
+def clusterLine(name, index):
+    return b'%s cluster %010d\n' % (name.encode(), index)
+
+
+def fileCluster(name, index, clusterSize):
+    line = clusterLine(name, index)
+    return (line * (clusterSize // len(line) + 1))[:clusterSize]
+
+
+def entryName(index):
+    return '%c%07d' % (ord('A') + index % 26, index)
+
+
+def entry(name, attr, cluster, size):
+    raw = bytearray(32)
+    raw[0:11] = name.ljust(11).encode() if isinstance(name, str) else name
+    raw[11] = attr
+    struct.pack_into('<H', raw, 20, cluster >> 16)
+    struct.pack_into('<HI', raw, 26, cluster & 0xFFFF, size)
+    return bytes(raw)
+
+
+class Image:
+    def __init__(self, out, size, sectorSize, clusterSize):
+        if clusterSize % sectorSize:
+            sys.exit('mkimage: the cluster size must be a multiple of the sector size')
+        self.out = open(out, 'wb')
+        self.out.truncate(size)
+        self.sectorSize = sectorSize
+        self.clusterSize = clusterSize
+        self.reserved = 32
+        self.numFats = 2
+        sectors = size // sectorSize
+        clusters = sectors // (clusterSize // sectorSize)
+        self.fatSectors = ((clusters + 2) * 4 + sectorSize - 1) // sectorSize
+        self.dataStart = (self.reserved + self.numFats * self.fatSectors) * sectorSize
+        self.numClusters = (size - self.dataStart) // clusterSize
+        if self.numClusters >= 0x0FFFFFF5:
+            sys.exit('mkimage: too many clusters for FAT32, use bigger clusters')
+        #the root directory is cluster 2
+        self.fat = {0: 0x0FFFFFF8, 1: 0x0FFFFFFF, 2: 0x0FFFFFFF}
+        self.next = 3
+
+        boot = bytearray(sectorSize)
+        boot[0:3] = b'\xEB\x58\x90'
+        boot[3:11] = b'MSWIN4.1'
+        struct.pack_into('<HBHBHHBHHHII', boot, 11, sectorSize, clusterSize // sectorSize,
+                         self.reserved, self.numFats, 0, 0, 0xF8, 0, 63, 255, 0,
+                         min(sectors, 0xFFFFFFFF))
+        struct.pack_into('<IHHIHH', boot, 36, self.fatSectors, 0, 0, 2, 1, 6)
+        boot[82:90] = b'FAT32   '
+        boot[510] = 0x55
+        boot[511] = 0xAA
+        self.write(0, boot)
+
+    def write(self, offset, data):
+        self.out.seek(offset)
+        self.out.write(data)
+
+    def clusterOffset(self, cluster):
+        return self.dataStart + (cluster - 2) * self.clusterSize
+
+    #a contiguous chain of count clusters, at offset when given
+    def allocate(self, count, offset=None):
+        start = self.next
+        if offset is not None:
+            start = max(2 + (max(offset - self.dataStart, 0) + self.clusterSize - 1) // self.clusterSize, self.next)
+        if start + count - 2 > self.numClusters:
+            sys.exit('mkimage: the image is too small')
+        chain = list(range(start, start + count))
+        for a, b in zip(chain, chain[1:]):
+            self.fat[a] = b
+        self.fat[chain[-1]] = 0x0FFFFFFF
+        if offset is None:
+            self.next = start + count
+        return chain
+
+    def writeChain(self, chain, data):
+        #runs of clusters are contiguous, so write them in large pieces
+        step = max(1, (8 << 20) // self.clusterSize)
+        for i in range(0, len(chain), step):
+            piece = data[i * self.clusterSize:(i + step) * self.clusterSize]
+            self.write(self.clusterOffset(chain[i]), piece)
+
+    def addFile(self, name, size, offset):
+        count = max(1, (size + self.clusterSize - 1) // self.clusterSize)
+        chain = self.allocate(count, offset)
+        step = max(1, (8 << 20) // self.clusterSize)
+        for i in range(0, count, step):
+            data = b''.join(fileCluster(name, k, self.clusterSize) for k in range(i, min(i + step, count)))
+            self.write(self.clusterOffset(chain[i]), data)
+        return entry(name, 0x20, chain[0], size)
+
+    def addDirectory(self, name, entries, offset, deleted=0, parent=0):
+        perCluster = self.clusterSize // 32
+        count = (entries + 2 + perCluster - 1) // perCluster
+        chain = self.allocate(count, offset)
+        raw = [entry(b'.          ', 0x10, chain[0], 0), entry(b'..         ', 0x10, parent, 0)]
+        raw += [entry(entryName(k), 0x20, 0, 0) for k in range(entries)]
+        if deleted:
+            step = 100.0 / deleted
+            for k in sorted({int(i * step) for i in range(int(entries * deleted / 100))}):
+                raw[2 + k] = b'\xE5' + raw[2 + k][1:]
+        self.writeChain(chain, b''.join(raw))
+        return entry(name, 0x10, chain[0], 0)
+
+    def finish(self, rootEntries):
+        self.writeChain([2], b''.join(rootEntries))
+        sectors = {}
+        for cluster, value in self.fat.items():
+            sector = cluster * 4 // self.sectorSize
+            raw = sectors.setdefault(sector, bytearray(self.sectorSize))
+            struct.pack_into('<I', raw, cluster * 4 % self.sectorSize, value)
+        for copy in range(self.numFats):
+            base = (self.reserved + copy * self.fatSectors) * self.sectorSize
+            for sector, raw in sectors.items():
+                self.write(base + sector * self.sectorSize, raw)
+        self.out.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='build a sparse FAT32 image')
+    parser.add_argument('out')
+    parser.add_argument('--size', required=True)
+    parser.add_argument('--sector', default='512')
+    parser.add_argument('--cluster', default='4K')
+    parser.add_argument('--file', action='append', default=[], help='NAME:BYTES[@OFFSET]')
+    parser.add_argument('--dir', action='append', default=[], help='NAME:ENTRIES[@OFFSET]')
+    parser.add_argument('--deleted', type=float, default=0, help='percentage of directory entries deleted')
+    args = parser.parse_args()
+
+    image = Image(args.out, parseSize(args.size), parseSize(args.sector), parseSize(args.cluster))
+    root = []
+    for item in args.dir:
+        name, entries, offset = parseItem(item)
+        root.append(image.addDirectory(name, entries, offset, args.deleted))
+    for item in args.file:
+        name, size, offset = parseItem(item)
+        root.append(image.addFile(name, size, offset))
+    if len(root) > image.clusterSize // 32:
+        sys.exit('mkimage: too many root entries')
+    image.finish(root)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+#check that offsets past 4 GiB and 2 TiB resolve to the right place.
+#
+#  bigimage.py [--filesys ./filesys] [--dir /tmp]
+#
+#builds two sparse images with bench/mkimage.py and drives filesys against them:
+#  8 GiB, 512 B sectors, 4 KB clusters: a file that crosses the 4 GiB mark and a
+#    directory past it
+#  2 TiB + 1 GiB, 4 KB sectors, 32 KB clusters: a file and a directory past 2 TiB
+#every read is compared with what mkimage wrote at that cluster, and a file
+#created in the far directory is looked for at the exact byte offset in the
+#image. the wall time of mount, 'ls' and a deep read is printed for each image
+import argparse
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, '..', 'bench'))
+import mkimage  # noqa: E402
+
+GIB = 1 << 30
+TIB = 1 << 40
+
+failures = 0
+
+
+def check(what, ok, detail=''):
+    global failures
+    print('%-52s %s%s' % (what, 'ok' if ok else 'FAILED', '' if ok else ': ' + detail))
+    if not ok:
+        failures += 1
+
+
+def filesys(binary, image, commands):
+    start = time.perf_counter()
+    result = subprocess.run([binary, '--no-flusher', image], input=('\n'.join(commands + ['exit']) + '\n').encode(),
+                            stdout=subprocess.PIPE, check=True)
+    return result.stdout.decode('latin-1'), time.perf_counter() - start
+
+
+def expectedBytes(name, offset, count, clusterSize):
+    data = b''
+    while len(data) < count:
+        index, within = divmod(offset + len(data), clusterSize)
+        data += mkimage.fileCluster(name, index, clusterSize)[within:within + count - len(data)]
+    return data.decode()
+
+
+#read count bytes at offset of a file and compare them with what mkimage wrote
+def checkRead(binary, image, name, offset, count, clusterSize, cd=None):
+    commands = (['cd ' + cd] if cd else []) + ['open %s -r' % name, 'lseek %s %d' % (name, offset),
+                                                'read %s %d' % (name, count)]
+    output, seconds = filesys(binary, image, commands)
+    match = re.search(r'.*\]/> (.*)\nRead %d bytes from file' % count, output, re.S)
+    got = match.group(1) if match else None
+    want = expectedBytes(name, offset, count, clusterSize)
+    check('read %s at %d' % (name, offset), got == want, repr(got))
+    return seconds
+
+
+def firstCluster(entry):
+    return struct.unpack_from('<H', entry, 20)[0] << 16 | struct.unpack_from('<H', entry, 26)[0]
+
+
+#byte offset in the image of a name's entry. mkimage lays a directory out in
+#consecutive clusters, so its first clusters are read as one run
+def entryOffset(image, built, dirEntry, name, clusters):
+    start = built.clusterOffset(firstCluster(dirEntry))
+    with open(image, 'rb') as raw:
+        raw.seek(start)
+        data = raw.read(clusters * built.clusterSize)
+    for i in range(0, len(data), 32):
+        #creat pads names with NULs, mkimage with spaces
+        if data[i:i + 11].rstrip(b' \0') == name.encode():
+            return start + i
+    return None
+
+
+def runImage(binary, image, title, size, sector, cluster, near, dirOffset, fileOffset):
+    print('%s (%d GiB, %d B sectors, %d KB clusters)' % (title, size // GIB, sector, cluster // 1024))
+    built = mkimage.Image(image, size, sector, cluster)
+    low = built.addFile('LOW', 3 * cluster, None)
+    far = built.addFile('FAR', 8 * cluster, fileOffset)
+    farDir = built.addDirectory('FARDIR', 300, dirOffset)
+    built.finish([low, far, farDir])
+    farCluster = firstCluster(far)
+    print('  FAR starts at byte %d, FARDIR at byte %d' % (built.clusterOffset(farCluster),
+                                                        built.clusterOffset(firstCluster(farDir))))
+    try:
+        output, mount = filesys(binary, image, ['info'])
+        check('mount reports the image size', 'Size of Image (in bytes): %d' % size in output, output)
+
+        output, lsTime = filesys(binary, image, ['ls'])
+        check('ls lists the root', all(n in output for n in ('LOW', 'FAR', 'FARDIR')), output)
+
+        checkRead(binary, image, 'LOW', cluster - 10, 40, cluster)
+        checkRead(binary, image, 'FAR', 0, 64, cluster)
+        readTime = checkRead(binary, image, 'FAR', 5 * cluster - 7, 100, cluster)
+        if near:
+            #the clusters either side of the mark
+            for index in range(8):
+                if built.clusterOffset(farCluster + index) >= near:
+                    checkRead(binary, image, 'FAR', index * cluster - 20, 40, cluster)
+                    break
+
+        output, _ = filesys(binary, image, ['cd FARDIR', 'ls'])
+        names = re.findall(r'^[A-Z][0-9]{7}', output, re.M)
+        check('ls FARDIR finds its 300 entries', len(names) == 300, '%d names' % len(names))
+
+        filesys(binary, image, ['cd FARDIR', 'creat NEWFILE'])
+        position = entryOffset(image, built, farDir, 'NEWFILE', (303 * 32 + cluster - 1) // cluster)
+        check('creat in FARDIR writes past %d GiB' % (dirOffset // GIB),
+              position is not None and position >= dirOffset, str(position))
+        output, _ = filesys(binary, image, ['cd FARDIR', 'ls'])
+        check('NEWFILE is listed after a remount', 'NEWFILE' in output, output)
+
+        print('  mount %.1f ms, ls %.1f ms, deep read %.1f ms' % (mount * 1e3, lsTime * 1e3, readTime * 1e3))
+    finally:
+        os.unlink(image)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='offsets past 4 GiB and 2 TiB')
+    parser.add_argument('--filesys', default=os.path.join(HERE, '..', 'filesys'))
+    parser.add_argument('--dir', default=tempfile.gettempdir())
+    args = parser.parse_args()
+
+    runImage(args.filesys, os.path.join(args.dir, 'bigimage-8g.img'), '8 GiB image',
+             8 * GIB, 512, 4096, 4 * GIB, 6 * GIB, 4 * GIB - 3 * 4096)
+    runImage(args.filesys, os.path.join(args.dir, 'bigimage-2t.img'), '2 TiB image',
+             2 * TIB + GIB, 4096, 32768, None, 2 * TIB + 256 * (1 << 20), 2 * TIB + 16 * (1 << 20))
+    if failures:
+        print('%d checks failed' % failures)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
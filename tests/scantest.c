@@ -0,0 +1,157 @@
+//scan resistance of the cluster cache: a working set that was hit twice sits on
+//the protected list, then a long sequential scan runs through the cache, once
+//with plain reads and once the way read-ahead does it (prefetch a window, then
+//read it). neither may push the working set out. last, a directory grows
+//through a one slot cache, where every new cluster evicts the directory's head
+#define main fat_main
+#include "../FAT.c"
+#undef main
+
+#define SCAN_SLOTS 64
+#define WORKING_SET 24
+#define SCAN_CLUSTERS 2000
+#define SCAN_WINDOW 16
+#define GROWTH_FILES 300
+
+//a throwaway image, 4 KB clusters and a data area big enough for the scan
+int makeImage(BootSectorInfo* bsi) {
+    char path[] = "/tmp/scantest-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(path);
+
+    unsigned char bootSector[512] = {0};
+    *(unsigned short*)(bootSector + 11) = 512;
+    bootSector[13] = 8;
+    *(unsigned short*)(bootSector + 14) = 32;
+    bootSector[16] = 2;
+    *(unsigned int*)(bootSector + 36) = 64;
+    *(unsigned int*)(bootSector + 44) = 2;
+    unsigned long long size = (32 + 2 * 64) * 512ULL + (SCAN_CLUSTERS + 200) * 4096ULL;
+    if (ftruncate(fd, size) < 0 || !parseBootSector(bootSector, size, bsi)) {
+        printf("Failed to set up the test image\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//hit every working set cluster twice so it lands on the protected list
+void warmWorkingSet(int fd, BootSectorInfo* bsi) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned int c = 10; c < 10 + WORKING_SET; c++) {
+            cacheLookup(fd, c, true, false, bsi);
+        }
+    }
+}
+
+//working set clusters that are no longer cached and protected
+int countEvicted() {
+    int evicted = 0;
+    for (unsigned int c = 10; c < 10 + WORKING_SET; c++) {
+        CacheSlot* slot = hashFind(c);
+        if (!slot || !slot->isProtected) evicted++;
+    }
+    return evicted;
+}
+
+bool check(const char* name, int evicted) {
+    printf("%-20s %d of %d working set clusters evicted: %s\n", name, evicted, WORKING_SET,
+           evicted == 0 ? "ok" : "FAILED");
+    return evicted == 0;
+}
+
+//creat GROWTH_FILES files in the root with one cache slot, then count the names
+//straight from the image
+bool checkGrowth(int fd, BootSectorInfo* bsi) {
+    uint32_t reserved[3] = { 0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF };
+    for (int copy = 0; copy < bsi->numFATs; copy++) {
+        off_t fat = fatOffsetInImage(bsi) + (off_t)copy * bsi->sectorsPerFAT * bsi->bytesPerSector;
+        if (!writeAt(fd, reserved, sizeof(reserved), fat)) {
+            return false;
+        }
+    }
+    if (!loadFatTable(fd, bsi) || !flushClusterCache(fd, bsi) || !resizeClusterCache(fd, 1, bsi)) {
+        printf("Failed to set up the growth test\n");
+        return false;
+    }
+
+    DirectoryContext root = { .currentCluster = bsi->rootCluster };
+    char name[12];
+    fflush(stdout);
+    int savedOut = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    for (int i = 1; i <= GROWTH_FILES; i++) {
+        snprintf(name, sizeof(name), "F%d", i);
+        createFile(fd, name, &root, bsi);
+    }
+    fflush(stdout);
+    dup2(savedOut, STDOUT_FILENO);
+    close(savedOut);
+    close(devNull);
+
+    int found = 0;
+    unsigned char* data = malloc(clusterBytes(bsi));
+    flushClusterCache(fd, bsi);
+    for (uint32_t c = bsi->rootCluster; data && c >= 2 && c < 0x0FFFFFF8; c = getNextCluster(fd, c, bsi)) {
+        if (!readAt(fd, data, clusterBytes(bsi), clusterOffset(c, bsi))) break;
+        for (unsigned int i = 0; i < entriesPerCluster(bsi); i++) {
+            const DirEntry* entry = (const DirEntry*)(data + i * DIR_ENTRY_SIZE);
+            if (entry->name[0] == 'F' && entry->attr != 0x0F) found++;
+        }
+    }
+    free(data);
+    printf("%-20s %d of %d files in the directory: %s\n", "growth, one slot", found, GROWTH_FILES,
+           found == GROWTH_FILES ? "ok" : "FAILED");
+    return found == GROWTH_FILES;
+}
+
+int main() {
+    BootSectorInfo bsi;
+    int fd = makeImage(&bsi);
+    if (fd < 0) {
+        return 1;
+    }
+    clusterCacheSlots = SCAN_SLOTS;
+    if (!initClusterCache(&bsi)) {
+        return 1;
+    }
+    bool ok = true;
+
+    //a plain scan, every cluster read once
+    warmWorkingSet(fd, &bsi);
+    for (unsigned int c = 100; c < 100 + SCAN_CLUSTERS; c++) {
+        cacheLookup(fd, c, true, false, &bsi);
+    }
+    ok = check("plain scan", countEvicted()) && ok;
+
+    //a read-ahead scan: each window is prefetched, then read once
+    warmWorkingSet(fd, &bsi);
+    unsigned int window[SCAN_WINDOW];
+    for (unsigned int c = 100; c < 100 + SCAN_CLUSTERS; c += SCAN_WINDOW) {
+        for (unsigned int i = 0; i < SCAN_WINDOW; i++) window[i] = c + i;
+        prefetchClusters(fd, window, SCAN_WINDOW, &bsi);
+        for (unsigned int i = 0; i < SCAN_WINDOW; i++) {
+            cacheLookup(fd, window[i], true, false, &bsi);
+        }
+    }
+    ok = check("read-ahead scan", countEvicted()) && ok;
+
+    //a read-ahead cluster read twice is part of the working set like any other
+    prefetchClusters(fd, window, 1, &bsi);
+    cacheLookup(fd, window[0], true, false, &bsi);
+    cacheLookup(fd, window[0], true, false, &bsi);
+    CacheSlot* slot = hashFind(window[0]);
+    bool promoted = slot && slot->isProtected;
+    printf("%-20s %s\n", "second reference", promoted ? "ok" : "FAILED");
+    ok = promoted && ok;
+
+    ok = checkGrowth(fd, &bsi) && ok;
+
+    close(fd);
+    return ok ? 0 : 1;
+}